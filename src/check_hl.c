@@ -0,0 +1,272 @@
+/* `make check`: the highlight drawn on the screen once the worker has caught
+ * up must be what lexing the whole file from its first line gives. The file
+ * is edited and paged through while batches are out, and a copy of its
+ * lines is lexed to know what every row should look like. A batch is taken,
+ * lexed and published on this thread, so where it goes out and comes back
+ * between edits is up to the check rather than to the scheduler. */
+#define main kiloMain
+#include "kilo.c"
+#undef main
+
+#define CHECK_ROWS 20000
+#define CHECK_STEPS 1000  // most steps a run of random edits takes
+
+char checkPath[PATH_MAX];
+char** checkLine;  // what every line of the file should hold
+ssize_t checkCount;
+
+void checkCleanup() { unlink(checkPath); }
+
+void checkFail(const char* what) {
+    fprintf(stderr, "check_hl: %s\n", what);
+    exit(1);
+}
+
+void checkBatchStart() {
+    if (!E.hl.running && hlSnapshot(&E.hl)) {
+        E.hl.running = 1;  // edits cut it from now on
+    }
+}
+
+void checkBatchFinish() {
+    if (E.hl.running) {
+        hlThread(&E.hl);
+        E.hl.running = 0;
+        hlPublish(&E.hl);
+    }
+}
+
+// let the worker go over the whole file, as it does while keys are awaited
+void checkDrain() {
+    checkBatchFinish();
+    for (;;) {
+        checkBatchStart();
+        if (!E.hl.running) {
+            break;
+        }
+        checkBatchFinish();
+    }
+    if (E.hlstale != E.numrows) {
+        checkFail("the worker stopped short of the end");
+    }
+}
+
+// draw the screen with `line` at the top, as paging there would
+void checkView(ssize_t line) {
+    E.cy = line < E.numrows ? line : E.numrows - 1;
+    E.cx = 0;
+    E.rowoff = E.cy;
+    E.coloff = 0;
+    screenBegin();
+    editorDrawRows();
+}
+
+// compare the rows drawn with the hl the lines get lexed from the top
+void checkScreen(const char* when) {
+    static unsigned char* hl;
+    static size_t hlcap;
+    int in = 0;
+    for (ssize_t i = 0; i < E.rowoff + E.screenrows && i < checkCount; i++) {
+        ssize_t len = strlen(checkLine[i]);
+        if ((size_t)len + 1 > hlcap) {
+            hlcap = (len + 1) * 2;
+            hl = realloc(hl, hlcap);
+            if (hl == NULL) {
+                die("realloc");
+            }
+        }
+        in = syntaxLex(E.syntax, checkLine[i], len, hl, 0, in, 1, -1);
+        if (i < E.rowoff) {
+            continue;
+        }
+        struct screenCell* cell = screenLine(i - E.rowoff);
+        for (ssize_t x = 0; x < len && x < E.screencols; x++) {
+            if (cell[x].attr != hl[x]) {
+                fprintf(stderr, "check_hl: %s, line %zd: \"%s\"\n", when, i,
+                        checkLine[i]);
+                checkFail("wrong highlight drawn");
+            }
+        }
+    }
+}
+
+void checkWriteFile(const char* first, int random) {
+    // comments are opened and closed rarely, so they run over many lines
+    const char* words[] = {"int", "a;", "x", "\"s\"", "//c", "1", "/*", "*/"};
+    FILE* fp = fopen(checkPath, "w");
+    if (fp == NULL) {
+        checkFail("can't create the file");
+    }
+    checkCount = CHECK_ROWS + 1;
+    checkLine = malloc(sizeof(char*) * (checkCount + CHECK_STEPS));
+    if (checkLine == NULL) {
+        die("malloc");
+    }
+    checkLine[0] = strdup(first);
+    for (ssize_t i = 1; i < checkCount; i++) {
+        char buf[64] = "int a;";
+        if (random) {
+            buf[0] = '\0';
+            for (int n = rand() % 6; n > 0; n--) {
+                int r = rand() % 100;
+                strcat(buf, words[r < 98 ? r % 6 : r - 92]);
+                strcat(buf, " ");
+            }
+        }
+        checkLine[i] = strdup(buf);
+    }
+    for (ssize_t i = 0; i < checkCount; i++) {
+        fprintf(fp, "%s\n", checkLine[i]);
+    }
+    fclose(fp);
+    editorOpen(checkPath);
+}
+
+void checkFreeLines() {
+    for (ssize_t i = 0; i < checkCount; i++) {
+        free(checkLine[i]);
+    }
+    free(checkLine);
+}
+
+/* A comment opened on the first line and never closed. The screen is paged
+ * down while the first batch is out, which loads the leaves there before the
+ * worker has come to them. */
+void checkOpenComment() {
+    checkWriteFile("/*", 0);
+    checkBatchStart();
+    checkView(1780);
+    checkDrain();
+    checkView(1793);
+    checkScreen("comment opened at the top");
+    checkFreeLines();
+}
+
+// one random edit where the cursor is, mirrored in checkLine
+void checkEdit() {
+    char* s = checkLine[E.cy];
+    ssize_t len = strlen(s);
+    E.cx = len ? rand() % (len + 1) : 0;
+    int what = rand() % 8;
+    if (what < 4) {
+        const char* chars = "/*\" ia;";
+        char c = chars[rand() % 7];  // may open or close a comment
+        editorInsertChar(c);
+        s = realloc(s, len + 2);
+        if (s == NULL) {
+            die("realloc");
+        }
+        memmove(s + E.cx, s + E.cx - 1, len - (E.cx - 1) + 1);
+        s[E.cx - 1] = c;
+        checkLine[E.cy] = s;
+    } else if (what < 6) {
+        if (E.cx == 0 && E.cy == 0) {
+            return;
+        }
+        ssize_t cy = E.cy, cx = E.cx;
+        editorDelChar();
+        if (cx > 0) {
+            memmove(s + cx - 1, s + cx, len - cx + 1);
+            return;
+        }
+        // joined to the line above
+        char* up = checkLine[cy - 1];
+        size_t uplen = strlen(up);
+        up = realloc(up, uplen + len + 1);
+        if (up == NULL) {
+            die("realloc");
+        }
+        memcpy(up + uplen, s, len + 1);
+        checkLine[cy - 1] = up;
+        free(s);
+        memmove(&checkLine[cy], &checkLine[cy + 1],
+                sizeof(char*) * (checkCount - cy - 1));
+        checkCount--;
+    } else {
+        ssize_t cy = E.cy, cx = E.cx;
+        editorInsertNewLine();
+        memmove(&checkLine[cy + 2], &checkLine[cy + 1],
+                sizeof(char*) * (checkCount - cy - 1));
+        checkLine[cy + 1] = strdup(s + cx);
+        s[cx] = '\0';
+        checkCount++;
+    }
+}
+
+ssize_t checkClamp(ssize_t line) {
+    return line < 0 ? 0 : line >= E.numrows ? E.numrows - 1 : line;
+}
+
+/* Random edits in random places, with batches going out and coming back in
+ * between. Every `every` steps the worker is let to catch up and the screen
+ * must then be right. Leaves are first loaded while the worker has yet to
+ * reach them, so short runs on a freshly opened file find the most. */
+void checkRandomEdits(unsigned seed, int steps, int every) {
+    srand(seed);
+    checkWriteFile("", 1);
+    ssize_t top = 0;
+    ssize_t* seen = malloc(sizeof(ssize_t) * every);  // tops since the drain
+    if (seen == NULL) {
+        die("malloc");
+    }
+    for (int step = 0; step < steps; step++) {
+        if (rand() % 2) {
+            checkBatchStart();
+        } else {
+            checkBatchFinish();
+        }
+        // mostly page far, to where leaves have not been loaded yet
+        if (rand() % 4 != 0) {
+            top = rand() % E.numrows;
+        } else {
+            top += rand() % 61 - 30;
+        }
+        checkView(checkClamp(top));
+        seen[step % every] = E.rowoff;
+        E.cy = E.rowoff + rand() % E.screenrows;
+        if (E.cy >= E.numrows) {
+            E.cy = E.numrows - 1;
+        }
+        if (rand() % 2) {
+            checkEdit();  // else only paging, which leaves the watermark be
+        }
+        if (checkCount != E.numrows) {
+            checkFail("lost track of the lines");
+        }
+        if (step % every == every - 1) {
+            // a little below everywhere the screen was, which shows rows of
+            // a leaf loaded there without the first of them, and drawing that
+            // first row would mend the rest
+            checkDrain();
+            for (int v = 0; v < every; v++) {
+                checkView(checkClamp(seen[v] + 13));
+                checkScreen("after random edits");
+            }
+        }
+        top = E.rowoff;
+    }
+    free(seen);
+    checkFreeLines();
+}
+
+int main() {
+    const char* tmp = getenv("TMPDIR");
+    snprintf(checkPath, sizeof(checkPath), "%s/kilo-check-hl-%d.c",
+             tmp && *tmp ? tmp : "/tmp", (int)getpid());
+    atexit(checkCleanup);
+    E.screenrows = 24;
+    E.screencols = 80;
+    pthread_mutex_init(&E.save.lock, NULL);
+    pthread_mutex_init(&E.hl.lock, NULL);
+    pthread_mutex_init(&E.find.lock, NULL);
+
+    checkOpenComment();
+    for (unsigned seed = 1; seed <= 100; seed++) {
+        checkRandomEdits(seed, 10, 10);
+    }
+    for (unsigned seed = 1; seed <= 2; seed++) {
+        checkRandomEdits(seed, CHECK_STEPS, 50);
+    }
+    printf("check_hl: ok\n");
+    return 0;
+}
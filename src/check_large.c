@@ -0,0 +1,162 @@
+/* `make check_large`: open a sparse file with one line of more than 4 GB
+ * between runs of short lines, edit its first and last lines, save it over
+ * itself and compare what was written with what should have been. The editor
+ * is built in with its main renamed, and driven through the same calls its
+ * keys end up in. The save writes the long line out in full, so the file is
+ * made in $TMPDIR, or the directory given, which wants 5 GB of disk; /tmp is
+ * often kept in memory. */
+#define main kiloMain
+#include "kilo.c"
+#undef main
+
+#define CHECK_LINES 1000                       // short lines before and after
+#define CHECK_HUGE ((4LL << 30) + (1 << 29) + 7)  // length of the long line
+#define CHECK_CHUNK (1 << 20)
+
+char checkPath[PATH_MAX];
+
+void checkCleanup() { unlink(checkPath); }
+
+void checkFail(const char* what) {
+    fprintf(stderr, "check_large: %s\n", what);
+    exit(1);
+}
+
+// the short lines that go before the long one if `tail` is 0, else after it
+void checkLines(struct abuf* ab, int tail) {
+    char buf[32];
+    for (int i = 0; i < CHECK_LINES; i++) {
+        int len = snprintf(buf, sizeof(buf), "line %d\n",
+                           tail ? CHECK_LINES + i : i);
+        abAppend(ab, buf, len);
+    }
+}
+
+void checkWrite(int fd, const char* s, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+        if (n <= 0) {
+            checkFail("write failed");
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+// the long line is left a hole, so the file takes next to no disk space
+void checkCreate(const char* path, struct abuf* head, struct abuf* tail) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        checkFail("can't create the file");
+    }
+    checkWrite(fd, head->b, head->len);
+    if (lseek(fd, CHECK_HUGE, SEEK_CUR) == -1) {
+        checkFail("lseek failed");
+    }
+    checkWrite(fd, "\n", 1);
+    checkWrite(fd, tail->b, tail->len);
+    close(fd);
+}
+
+// read exactly len bytes of fd into buf
+void checkRead(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            checkFail("saved file is too short");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// the saved file must be head, the long line of zeros, a newline and tail
+void checkCompare(const char* path, struct abuf* head, struct abuf* tail) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        checkFail("can't open the saved file");
+    }
+    char* buf = malloc(CHECK_CHUNK);
+    char* zero = calloc(1, CHECK_CHUNK);
+    if (buf == NULL || zero == NULL) {
+        die("malloc");
+    }
+
+    checkRead(fd, buf, head->len);
+    if (memcmp(buf, head->b, head->len)) {
+        checkFail("lines before the long one differ");
+    }
+    for (long long left = CHECK_HUGE; left > 0; left -= CHECK_CHUNK) {
+        size_t len = left < CHECK_CHUNK ? left : CHECK_CHUNK;
+        checkRead(fd, buf, len);
+        if (memcmp(buf, zero, len)) {
+            checkFail("the long line differs");
+        }
+    }
+    checkRead(fd, buf, 1);
+    if (buf[0] != '\n') {
+        checkFail("the long line is not ended");
+    }
+    checkRead(fd, buf, tail->len);
+    if (memcmp(buf, tail->b, tail->len)) {
+        checkFail("lines after the long one differ");
+    }
+    if (read(fd, buf, 1) != 0) {
+        checkFail("saved file is too long");
+    }
+    close(fd);
+    free(buf);
+    free(zero);
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = argc > 1 ? argv[1] : getenv("TMPDIR");
+    snprintf(checkPath, sizeof(checkPath), "%s/kilo-check-large-%d.txt",
+             dir && *dir ? dir : "/tmp", (int)getpid());
+    atexit(checkCleanup);  // die and checkFail leave through exit too
+    const char* path = checkPath;
+    E.screenrows = 24;
+    E.screencols = 80;
+    pthread_mutex_init(&E.save.lock, NULL);
+    pthread_mutex_init(&E.hl.lock, NULL);
+    pthread_mutex_init(&E.find.lock, NULL);
+
+    struct abuf head = ABUF_INIT;
+    struct abuf tail = ABUF_INIT;
+    checkLines(&head, 0);
+    checkLines(&tail, 1);
+    checkCreate(path, &head, &tail);
+
+    editorOpen((char*)path);
+    if (E.numrows != 2 * CHECK_LINES + 1) {
+        checkFail("wrong number of lines");
+    }
+    if (editorRow(CHECK_LINES)->size != CHECK_HUGE) {
+        checkFail("wrong length of the long line");
+    }
+
+    // put a char at the start of the first line and the end of the last
+    E.cy = 0;
+    E.cx = 0;
+    editorInsertChar('>');
+    E.cy = E.numrows - 1;
+    E.cx = editorRow(E.cy)->size;
+    editorInsertChar('<');
+
+    editorSave();
+    editorSaveWait();
+    if (E.dirty) {
+        checkFail(E.statusmsg);
+    }
+
+    // what the edits should have made of the lines around the long one
+    abAppend(&head, ">", 1);
+    memmove(head.b + 1, head.b, head.len - 1);
+    head.b[0] = '>';
+    abAppend(&tail, "\n", 1);
+    tail.b[tail.len - 2] = '<';
+
+    checkCompare(path, &head, &tail);
+    printf("check_large: ok\n");
+    return 0;
+}
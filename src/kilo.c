@@ -44,18 +44,28 @@
 #include <asm-generic/errno-base.h>
 #include <asm-generic/ioctls.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 /*+++ defines +++*/
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
@@ -89,7 +99,50 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+#define ROW_STALE_RENDER (1 << 0)
+#define ROW_STALE_HL (1 << 1)
+#define ROW_STALE_TABS (1 << 2)
+
+/* A span is a run of render columns of one HL_* class: the class in the low
+ * HL_SPAN_BITS bits, the length above them. */
+#define HL_SPAN_BITS 3
+#define HL_SPAN_MAX ((1 << (16 - HL_SPAN_BITS)) - 1)
+#define HL_SPAN(hl, len) ((hlSpan)((len) << HL_SPAN_BITS | (hl)))
+#define HL_SPAN_HL(s) ((s) & ((1 << HL_SPAN_BITS) - 1))
+#define HL_SPAN_LEN(s) ((s) >> HL_SPAN_BITS)
+
 /*+++ data +++*/
+
+/* A syntax is compiled into a lexer the first time it is selected: a table
+ * of what every byte can be or start, and the keywords in a hash table keyed
+ * by the whole word, so the highlighter never strlen's or strncmp's its way
+ * through the definition. Keywords are words: they are looked up as the run
+ * of non separator bytes at a word start. */
+#define LEX_SEP (1 << 0)
+#define LEX_DIGIT (1 << 1)
+#define LEX_QUOTE (1 << 2)
+#define LEX_SCS (1 << 3)   // first byte of the single line comment start
+#define LEX_MCS (1 << 4)   // first byte of the multi line comment start
+#define LEX_MCE (1 << 5)   // first byte of the multi line comment end
+#define LEX_WORD (1 << 6)  // first byte of some keyword
+
+struct syntaxKeyword {
+    const char* word;  // NULL for an empty slot
+    int len;
+    unsigned char hl;
+};
+
+struct syntaxLexer {
+    unsigned char cls[256];  // LEX_* bits of every byte
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+    int look;   // see editorSyntaxLookahead
+    int maxkw;  // length of the longest keyword
+    unsigned int kwmask;
+    struct syntaxKeyword* kw;  // open addressing, kwmask + 1 slots
+};
+
 struct editorSyntax {
     char* filetype;
     char** filematch;
@@ -98,31 +151,362 @@ struct editorSyntax {
     char* multiline_comment_start;
     char* multiline_comment_end;
     int flags;
+    struct syntaxLexer* lexer;  // compiled on first use
+};
+
+/* Row buffers are carved out of large slabs by size class: 16 byte steps up
+ * to 128 bytes, powers of two above that. A buffer keeps its whole class as
+ * capacity, so it can grow in place until it outgrows the class, and closing
+ * the file hands back every slab at once instead of freeing row by row.
+ * Anything bigger than the largest class is malloc'd on its own but still
+ * tracked here so it is released with the rest. */
+#define ARENA_SMALL_MAX 128
+#define ARENA_CLASSES 19  // 16..128 in steps of 16, then 256 .. 256 KB
+#define ARENA_SLAB_SIZE (4 << 20)
+
+struct arenaSlab {
+    struct arenaSlab* next;
+    size_t used;
+};
+
+struct arenaHuge {
+    struct arenaHuge* prev;
+    struct arenaHuge* next;
+};
+
+struct rowArena {
+    struct arenaSlab* slabs;  // newest first, carving happens in the head
+    struct arenaHuge* huge;
+    void* freelist[ARENA_CLASSES];
+    size_t reserved;   // bytes taken from malloc for slabs and huge blocks
+    size_t allocated;  // bytes of blocks handed out, counted at class size
+    size_t requested;  // bytes callers actually asked for
+};
+
+struct rowTab {
+    ssize_t cx;  // char index of a tab
+    ssize_t rx;  // render column it starts at
 };
 
+/* The hl of a row is kept as spans, longer runs are split. The HL_NORMAL run
+ * a row ends in is not stored, so plain text costs nothing. */
+typedef unsigned short hlSpan;
+
+/* Kept to 128 bytes, the size class of the arena rows come from: the small
+ * fields go together at the end so none of them is padded. */
 typedef struct erow {
-    int idx;
-    int size;
-    int rsize;
+    struct ropeNode* leaf;  // leaf of the row tree that holds this row
+    ssize_t size;
+    ssize_t rsize;
+    ssize_t gap;  // chars before the gap, see editorRowTail
     char* chars;
     char* render;
-    unsigned char* hl;
-    int hl_open_comment;
+    hlSpan* hl;
+    ssize_t nspans;
+    struct rowTab* tabs;  // every tab in the row, for mapping cx and rx
+    ssize_t ntabs;
+    size_t ccap;  // arena capacities of chars, render, hl and tabs
+    size_t rcap;
+    size_t hlcap;
+    size_t tabcap;
+    int slot;     // position of this row inside its leaf
+    int savegen;  // chars are read by the running save if it equals its gen
+    unsigned version;  // bumped whenever render changes, see hlJob
+    signed char hl_open_comment;
+    unsigned char stale;   // ROW_STALE_* bits of the caches to recompute
+    unsigned char mapped;  // chars point into the read only file mapping
 } erow;
 
+/* Rows are kept in a B+ tree, a rope of line chunks: leaves hold up to
+ * ROPE_LEAF_MAX rows, inner nodes hold up to ROPE_NODE_MAX children and every
+ * node knows how many rows live below it. Finding, inserting or deleting a
+ * row by line number walks a single root to leaf path, so all of them are
+ * O(log n) instead of shifting the whole tail of the file.
+ *
+ * A file opened through mmap starts out as leaves that only remember where
+ * their first line is in the mapping. Their rows are created the first time
+ * anything looks at the leaf.
+ *
+ * Every leaf is also a checkpoint of the highlighter: hlin is the comment
+ * state its first row is lexed from. A row far down the file can then be
+ * highlighted from the start of its own leaf instead of from the top, and
+ * the worker lexes unloaded leaves straight from the mapping to fill them
+ * in without creating their rows. */
+#define ROPE_LEAF_MAX 64
+#define ROPE_NODE_MAX 16
+
+typedef struct ropeNode {
+    struct ropeNode* parent;
+    struct ropeNode* prev;  // neighbouring leaves, for walking rows in order
+    struct ropeNode* next;
+    int leaf;     // 1 if the slots hold rows, 0 if they hold child nodes
+    int count;    // number of used slots
+    ssize_t numrows;  // number of rows in this subtree
+    union {
+        struct ropeNode* child[ROPE_NODE_MAX];
+        erow** rows;  // ROPE_LEAF_MAX slots, NULL while still in the mapping
+    } u;
+    const char* map;  // first line of an unloaded leaf inside E.map
+    int hlin;   // comment state the first row starts in, -1 if not known
+    int stale;  // ROW_STALE_HL until an unloaded leaf is lexed from hlin
+} ropeNode;
+
+/* Ctrl-S takes a snapshot of the document and hands it to a writer thread.
+ * The snapshot only points at text: runs of lines still in the mapping and
+ * the two halves of every loaded row. A row whose chars are in the snapshot
+ * copies them before it is first edited and leaves the old block to the
+ * writer, which is freed once the save is over. */
+struct savePiece {
+    const char* a;  // text before the gap, or the first of `lines` lines
+    ssize_t alen;
+    const char* b;  // text after the gap
+    ssize_t blen;
+    int lines;  // number of lines at `a` in the mapping, 0 for a loaded row
+};
+
+struct saveOrphan {
+    char* chars;
+    size_t cap;
+};
+
+struct saveJob {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running;  // a writer thread was started and not joined yet
+    int gen;      // generation of the current snapshot, see erow.savegen
+    char* path;
+    mode_t mode;  // permissions a new file gets, from the umask
+    struct savePiece* pieces;
+    ssize_t npieces;
+    ssize_t numrows;
+    int dirty;  // E.dirty when the snapshot was taken
+    struct saveOrphan* orphans;
+    ssize_t norphans;
+    ssize_t orphcap;
+    int shown;  // progress last put on the status bar, in percent
+    // written by the writer thread, under lock
+    int done;
+    ssize_t lines;  // lines written so far
+    ssize_t len;    // bytes written, -1 if the save failed
+    int err;
+};
+
+/* A regular expression compiled into NFA states. The start and the end of a
+ * row are symbols of their own, after the 256 bytes, which ^ and $ take. */
+#define RE_BOL 256
+#define RE_EOL 257
+#define RE_SYMBOLS 258
+#define RE_NFA_MAX 8192    // states a pattern may compile into
+#define RE_DFA_MAX 512  // DFA states kept before they are dropped, power of 2
+#define RE_REPEAT_MAX 256  // largest count in {m,n}
+
+enum reOp {
+    RE_SET,    // takes a byte in set
+    RE_ANY,    // takes any symbol
+    RE_MARK,   // takes the symbol in sym, RE_BOL or RE_EOL
+    RE_SPLIT,  // goes on to both out and out1 without taking anything
+    RE_MATCH
+};
+
+struct reState {
+    int op;
+    int out;
+    int out1;
+    int sym;
+    unsigned char set[32];
+};
+
+struct regex {
+    struct reState* st;
+    int nst;
+    int cap;
+    int fwd;    // forwards, matching where it is started
+    int fwd0;   // the same at the start of a row, where ^ may come first
+    int ufwd;   // forwards, matching anywhere
+    int urev;   // backwards, matching anywhere
+    int nullable;  // some match is empty
+};
+
+// a set of NFA states
+struct reDState {
+    int* set;  // sorted
+    int nset;  // 0 for the state nothing gets out of
+    int match;
+    int next[RE_SYMBOLS];  // the state after each symbol, -1 until taken
+};
+
+/* A DFA state is passed around as its index shifted up by one, with the low
+ * bit set if it matches, so a loop over text loads one int per byte. */
+
+// an NFA run from one start state, as a DFA built while it runs
+struct reDfa {
+    const struct regex* re;
+    int start;
+    int init;  // the state it starts in, -1 until built
+    struct reDState* states;
+    int nstates;
+    int cap;
+    unsigned resets;  // times the states were dropped
+    int* table;  // the states by set, open addressing
+    int* mark;   // scratch for building a set, per NFA state
+    int gen;
+    int* stack;
+    int* buf;
+    int nbuf;
+};
+
+// a search query made ready for findIn, or a compiled regex
+struct findNeedle {
+    const char* s;
+    ssize_t len;
+    int icase;  // s is in lower case and matches text in either case
+    unsigned char fold;   // ORed into the text before comparing
+    unsigned char first;  // first and last byte of s, folded
+    unsigned char last;
+    struct regex* re;  // NULL for plain text
+};
+
+/* What one thread searches a needle with. The DFAs of a regex are built as
+ * the text is searched, so each thread has its own. */
+struct findMatcher {
+    const struct findNeedle* nd;
+    struct reDfa fwd, fwd0, ufwd, urev;
+    char* starts;  // where a match starts, in the row searched last
+    ssize_t startscap;
+    const char* sp;  // that row, and where its search began
+    ssize_t slen;
+    ssize_t sfrom;
+};
+
+/* The lines matching the search query while the prompt is up, and how many
+ * matches each has. A longer query only matches where the one before it
+ * did, so as it grows only these lines are searched again, unless it is a
+ * regex. Matches are counted from 0 through the lines in order; before[]
+ * turns a match into its line with a binary search. */
+struct findState {
+    char* query;     // what lines was found for, NULL if nothing was searched
+    struct findNeedle nd;  // query, for drawing its matches
+    struct findMatcher m;  // nd, on the main thread
+    int regex;  // queries are regular expressions, toggled with Ctrl-R
+    const char* error;  // why query does not compile, NULL if it does
+    ssize_t* lines;  // every line whose render holds query, in order
+    ssize_t* before;  // matches in the lines before each of them
+    ssize_t nlines;
+    ssize_t total;  // matches in all of them
+    ssize_t cur;    // the match the cursor is on
+    pthread_mutex_t lock;
+    int cancel;  // a key came in while searching, under lock
+};
+
+#define FIND_CHUNK_MIN (1 << 16)  // lines searched per thread at least
+#define FIND_THREADS_MAX 64
+#define FIND_POLL_LEAVES 16  // leaves searched between looks for a key
+
+/* Stale rows are lexed on a worker thread, a batch of consecutive rows at a
+ * time in document order. The batch holds a copy of the render of each row
+ * together with the version of the row it was taken at. The finished hl is
+ * copied back into every row that still has that version, and until then
+ * the screen shows rows with the hl they had before. Leaves still in the
+ * mapping are lexed right there and only leave checkpoints behind. */
+#define HL_SYNC_ROWS 256      // stale rows the screen may highlight itself
+#define HL_BATCH_ROWS 16384   // lines handed to the worker at once
+#define HL_BATCH_BYTES (1 << 22)
+#define HL_POLL_MS 5  // how often the main loop looks for a finished batch
+
+struct hlEntry {
+    erow* row;         // NULL for a whole leaf that is still in the mapping
+    ropeNode* leaf;    // that leaf, rows find theirs through row->leaf
+    unsigned version;  // row->version when its render was copied
+    ssize_t line;      // first line of the entry, counted from the batch start
+    ssize_t lines;     // 1 for a row
+    const char* map;   // first line of an unloaded leaf
+    ssize_t off;       // render at text + off, the new hl at hl + off
+    ssize_t rsize;
+    int stale;  // the entry needs lexing even if the state it starts in holds
+    int open;   // state the entry ends in, as lexed once `lexed` is set
+    int lexed;
+};
+
+struct hlJob {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running;  // a worker thread was started and not joined yet
+    struct editorSyntax* syntax;
+    ssize_t start;  // line of the first row in the batch
+    ssize_t valid;  // leading lines that no edit has touched since the copy
+    int in;         // comment state the first entry starts in
+    struct hlEntry* rows;
+    ssize_t nrows;
+    ssize_t rowcap;
+    char* text;
+    unsigned char* hl;
+    size_t textcap;
+    char* scratch;  // a mapped line and its hl, only used by the worker
+    unsigned char* scratchhl;
+    size_t scratchcap;
+    int done;  // written by the worker, under lock
+};
+
+/* Output collected to be written at once. The buffer only grows, doubling,
+ * so one that is kept and emptied for every frame stops allocating. */
+struct abuf {
+    char* b;
+    ssize_t len;
+    ssize_t cap;
+};
+
+#define ABUF_INIT \
+    { NULL, 0, 0 }
+
+/* A cell of the screen: the byte shown and its highlight, with
+ * SCREEN_INVERSE for inverted colors. */
+struct screenCell {
+    char c;
+    unsigned char attr;
+};
+
+#define SCREEN_INVERSE 0x80
+#define SCREEN_GAP 6  // unchanged cells written over rather than moved past
+
+/* The screen as the terminal shows it, and the next one. A refresh draws
+ * every cell of next, writes only what differs from cur and swaps them, so
+ * a keypress costs about as many bytes as it changed on the screen. */
+struct screenState {
+    struct screenCell* cur;
+    struct screenCell* next;
+    int rows;
+    int cols;
+    int valid;  // cur is what the terminal shows
+    ssize_t cy, cx;   // where the cursor was left
+    ssize_t rowoff, coloff;  // the part of the file cur shows
+    ssize_t written;  // bytes the last refresh wrote
+    struct abuf out;  // what a refresh writes, kept from one to the next
+};
+
 struct editorConfig {
-    int cx, cy;  // x and y position in column
-    int rx;
-    int rowoff;      // row offset
-    int coloff;      // column offset
-    int screenrows;  // number of rows that can be displayed
-    int screencols;  // number of columns that can be displayed
-    int numrows;     // number of rows of actual text we have
-    erow* row;       // dynamic array of all rows in the file
+    ssize_t cx, cy;  // x and y position in column
+    ssize_t rx;
+    ssize_t rowoff;   // row offset
+    ssize_t coloff;   // column offset
+    int screenrows;   // number of rows that can be displayed
+    int screencols;   // number of columns that can be displayed
+    ssize_t numrows;  // number of rows of actual text we have
+    ropeNode* rows;   // root of the tree holding all rows in the file
+    ssize_t hlstale;  // every row above this line has an up to date hl
+    char* map;       // read only mapping of the opened file, if any
+    size_t maplen;
+    struct rowArena arena;  // backing store of every row and its buffers
+    struct saveJob save;  // background save, if one is running
+    struct hlJob hl;      // background highlighter
+    struct findState find;  // matches of the search in progress
+    struct screenState screen;  // what was last written to the terminal
+    unsigned char* hlbuf;  // a row's hl a byte per column, see editorRowHl
+    size_t hlbufcap;
     int dirty;
     char* filename;  // name of currently opened file
     char statusmsg[80];
     time_t statusmsg_time;
+    int prompting;  // a prompt owns the status bar
     struct editorSyntax* syntax;
     struct termios orig_termios;
 };
@@ -138,13 +522,21 @@ char* C_HL_keywords[] = {"switch",    "if",      "while",   "for",    "break",
                          "unsigned|", "signed|", "void|",   NULL};
 struct editorSyntax HLDB[] = {
     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL},
 };
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /*+++ prototypes ++*/
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
+void editorRowRender(erow* row);
+int editorSavePoll();
+void editorSaveWait();
+void editorUpdateSyntax(erow* row);
+void editorLeafHighlight(erow* row);
+void editorMarkStale(ssize_t at);
+void editorMarkMoved(ropeNode* leaf);
+int editorHighlightPoll();
 char* editorPrompt(char* prompt, void (*callback)(char*, int));
 
 /*+++ terminal +++*/
@@ -208,7 +600,18 @@ void enableRawMode() {
 int editorReadKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    while (1) {
+        if (editorSavePoll() | editorHighlightPoll()) {
+            editorRefreshScreen();
+        }
+        // don't sit out the whole read timeout while a batch is being lexed
+        if (E.hl.running && poll(&in, 1, HL_POLL_MS) == 0) {
+            continue;
+        }
+        if ((nread = read(STDIN_FILENO, &c, 1)) == 1) {
+            break;
+        }
         if (nread == -1 && errno != EAGAIN) {
             die("read");
         }
@@ -312,484 +715,3499 @@ int getWindowSize(int* rows, int* cols) {
     }
 }
 
-/*+++ syntax highlighting +++*/
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+/*+++ row memory +++*/
+int arenaClass(size_t size, size_t* cap) {
+    if (size <= ARENA_SMALL_MAX) {
+        int c = size ? (int)((size - 1) / 16) : 0;
+        *cap = (c + 1) * 16;
+        return c;
+    }
+    int c = ARENA_SMALL_MAX / 16;
+    size_t csize = ARENA_SMALL_MAX * 2;
+    while (csize < size) {
+        csize *= 2;
+        c++;
+    }
+    *cap = csize;
+    return c;
 }
 
-void editorUpdateSyntax(erow* row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+/* Hand out a block of at least `size` bytes, its real capacity goes to
+ * *cap. */
+void* arenaAlloc(size_t size, size_t* cap) {
+    struct rowArena* a = &E.arena;
+    int c = arenaClass(size, cap);
+    void* p;
+
+    if (c >= ARENA_CLASSES) {
+        struct arenaHuge* h = malloc(sizeof(struct arenaHuge) + *cap);
+        if (h == NULL) {
+            die("malloc");
+        }
+        h->prev = NULL;
+        h->next = a->huge;
+        if (a->huge) {
+            a->huge->prev = h;
+        }
+        a->huge = h;
+        a->reserved += sizeof(struct arenaHuge) + *cap;
+        p = h + 1;
+    } else if (a->freelist[c]) {
+        p = a->freelist[c];
+        a->freelist[c] = *(void**)p;
+    } else {
+        struct arenaSlab* slab = a->slabs;
+        if (slab == NULL || slab->used + *cap > ARENA_SLAB_SIZE) {
+            slab = malloc(sizeof(struct arenaSlab) + ARENA_SLAB_SIZE);
+            if (slab == NULL) {
+                die("malloc");
+            }
+            slab->next = a->slabs;
+            slab->used = 0;
+            a->slabs = slab;
+            a->reserved += sizeof(struct arenaSlab) + ARENA_SLAB_SIZE;
+        }
+        p = (char*)(slab + 1) + slab->used;
+        slab->used += *cap;
+    }
+    a->allocated += *cap;
+    a->requested += size;
+    return p;
+}
 
-    if (E.syntax == NULL) {
+/* Give back a block that was holding `size` bytes. `cap` is its capacity,
+ * or anything that rounds up to it. */
+void arenaFree(void* p, size_t cap, size_t size) {
+    struct rowArena* a = &E.arena;
+    if (p == NULL) {
         return;
     }
+    int c = arenaClass(cap, &cap);
+    if (c >= ARENA_CLASSES) {
+        struct arenaHuge* h = (struct arenaHuge*)p - 1;
+        if (h->prev) h->prev->next = h->next;
+        if (h->next) h->next->prev = h->prev;
+        if (a->huge == h) a->huge = h->next;
+        a->reserved -= sizeof(struct arenaHuge) + cap;
+        free(h);
+    } else {
+        *(void**)p = a->freelist[c];
+        a->freelist[c] = p;
+    }
+    a->allocated -= cap;
+    a->requested -= size;
+}
 
-    char** keywords = E.syntax->keywords;
+/* Resize a block from `oldsize` to `size` bytes. It stays where it is while
+ * it fits its class, otherwise it moves to a bigger one. */
+void* arenaRealloc(void* p, size_t* cap, size_t oldsize, size_t size) {
+    if (p && size <= (size_t)*cap) {
+        E.arena.requested += size - oldsize;
+        return p;
+    }
+    size_t newcap;
+    void* np = arenaAlloc(size, &newcap);
+    if (p) {
+        memcpy(np, p, oldsize < size ? oldsize : size);
+        arenaFree(p, *cap, oldsize);
+    }
+    *cap = newcap;
+    return np;
+}
 
-    char* mcs = E.syntax->multiline_comment_start;
-    char* mce = E.syntax->multiline_comment_end;
-    char* scs = E.syntax->singleline_comment_start;
+// drop every row buffer at once
+void arenaReset() {
+    struct rowArena* a = &E.arena;
+    while (a->slabs) {
+        struct arenaSlab* next = a->slabs->next;
+        free(a->slabs);
+        a->slabs = next;
+    }
+    while (a->huge) {
+        struct arenaHuge* next = a->huge->next;
+        free(a->huge);
+        a->huge = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+/*+++ row storage +++*/
+erow* editorNewRow(char* chars, ssize_t size, int mapped) {
+    size_t cap;
+    erow* row = arenaAlloc(sizeof(erow), &cap);
+    row->size = size;
+    row->chars = chars;
+    row->gap = size;
+    row->ccap = 0;
+    row->mapped = mapped;
+    row->rsize = 0;
+    row->render = NULL;
+    row->rcap = 0;
+    row->hl = NULL;
+    row->nspans = 0;
+    row->hlcap = 0;
+    row->tabs = NULL;
+    row->ntabs = 0;
+    row->tabcap = 0;
+    row->hl_open_comment = 0;
+    row->stale = ROW_STALE_RENDER | ROW_STALE_HL | ROW_STALE_TABS;
+    row->savegen = 0;
+    row->version = 0;
+    return row;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+ropeNode* ropeNewNode(int leaf) {
+    ropeNode* n = calloc(1, sizeof(ropeNode));
+    if (n == NULL) {
+        die("calloc");
+    }
+    n->leaf = leaf;
+    n->hlin = -1;
+    n->stale = ROW_STALE_HL;
+    if (leaf) {
+        n->u.rows = malloc(sizeof(erow*) * ROPE_LEAF_MAX);
+        if (n->u.rows == NULL) {
+            die("malloc");
+        }
+    }
+    return n;
+}
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void ropeFreeNode(ropeNode* n) {
+    if (n->leaf) {
+        free(n->u.rows);
+    }
+    free(n);
+}
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+// free the nodes of a subtree, the rows are left to the arena
+void ropeFreeTree(ropeNode* n) {
+    if (!n->leaf) {
+        for (int j = 0; j < n->count; j++) {
+            ropeFreeTree(n->u.child[j]);
+        }
+    }
+    ropeFreeNode(n);
+}
+
+// find the end of the mapped line starting at p, trailing CRs excluded
+const char* ropeMapLine(const char* p, ssize_t* len) {
+    const char* end = E.map + E.maplen;
+    const char* nl = memchr(p, '\n', end - p);
+    const char* eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r') {
+        eol--;
+    }
+    *len = eol - p;
+    return nl ? nl + 1 : end;
+}
+
+/* Create the rows of a leaf that is still only a range of the mapping. They
+ * start out with stale render and hl, like every new row. */
+void ropeLoadLeaf(ropeNode* n) {
+    if (n->u.rows) {
+        return;
+    }
+    n->u.rows = malloc(sizeof(erow*) * ROPE_LEAF_MAX);
+    if (n->u.rows == NULL) {
+        die("malloc");
+    }
+    const char* p = n->map;
+    for (int j = 0; j < n->count; j++) {
+        ssize_t len;
+        const char* next = ropeMapLine(p, &len);
+        erow* row = editorNewRow((char*)p, len, 1);
+        row->leaf = n;
+        row->slot = j;
+        n->u.rows[j] = row;
+        p = next;
+    }
+    n->map = NULL;
+}
+
+// leftmost leaf, without loading it
+ropeNode* ropeFirstLeaf() {
+    ropeNode* n = E.rows;
+    while (n && !n->leaf) {
+        n = n->u.child[0];
+    }
+    return n;
+}
+
+/* Build the tree bottom up from a run of leaves, grouping ROPE_NODE_MAX nodes
+ * under each parent until a single root is left. */
+ropeNode* ropeBuild(ropeNode** nodes, ssize_t count) {
+    while (count > 1) {
+        ssize_t parents = 0;
+        for (ssize_t i = 0; i < count; i += ROPE_NODE_MAX) {
+            ropeNode* p = ropeNewNode(0);
+            for (ssize_t j = i; j < count && j < i + ROPE_NODE_MAX; j++) {
+                p->u.child[p->count++] = nodes[j];
+                p->numrows += nodes[j]->numrows;
+                nodes[j]->parent = p;
             }
+            nodes[parents++] = p;
         }
+        count = parents;
+    }
+    return nodes[0];
+}
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
+// point the slots of n from `from` onwards back at n
+void ropeAdopt(ropeNode* n, int from) {
+    for (int j = from; j < n->count; j++) {
+        if (n->leaf) {
+            n->u.rows[j]->leaf = n;
+            n->u.rows[j]->slot = j;
+        } else {
+            n->u.child[j]->parent = n;
+        }
+    }
+}
+
+// line number of the first row below n, found by walking up to the root
+ssize_t ropeLine(ropeNode* n) {
+    ssize_t at = 0;
+    while (n->parent) {
+        ropeNode* p = n->parent;
+        for (int j = 0; p->u.child[j] != n; j++) {
+            at += p->u.child[j]->numrows;
+        }
+        n = p;
+    }
+    return at;
+}
+
+int ropeIsFull(ropeNode* n) {
+    return n->count == (n->leaf ? ROPE_LEAF_MAX : ROPE_NODE_MAX);
+}
+
+// split the full child j of p into two halves, the new one going to j + 1
+void ropeSplitChild(ropeNode* p, int j) {
+    ropeNode* left = p->u.child[j];
+    int half = left->count / 2;
+    if (left->leaf) {
+        ropeLoadLeaf(left);
+        editorMarkMoved(left);
+        // so the state the new leaf starts in is known
+        if (E.syntax && (left->u.rows[half - 1]->stale & ROW_STALE_HL)) {
+            editorLeafHighlight(left->u.rows[half - 1]);
+        }
+    }
+    ropeNode* right = ropeNewNode(left->leaf);
+
+    right->count = left->count - half;
+    if (left->leaf) {
+        memcpy(right->u.rows, &left->u.rows[half],
+               sizeof(erow*) * right->count);
+        right->numrows = right->count;
+        // the row before the cut ends in the state the new leaf starts in
+        erow* last = left->u.rows[half - 1];
+        right->hlin =
+            (last->stale & ROW_STALE_HL) ? -1 : last->hl_open_comment;
+        right->prev = left;
+        right->next = left->next;
+        if (left->next) {
+            left->next->prev = right;
+        }
+        left->next = right;
+    } else {
+        memcpy(right->u.child, &left->u.child[half],
+               sizeof(ropeNode*) * right->count);
+        for (int k = 0; k < right->count; k++) {
+            right->numrows += right->u.child[k]->numrows;
+        }
+    }
+    left->count = half;
+    left->numrows -= right->numrows;
+    ropeAdopt(right, 0);
+
+    memmove(&p->u.child[j + 2], &p->u.child[j + 1],
+            sizeof(ropeNode*) * (p->count - j - 1));
+    p->u.child[j + 1] = right;
+    p->count++;
+    right->parent = p;
+}
+
+/* Insert a row so that it ends up at line `at`. Full nodes are split on the
+ * way down, so there is always room in the leaf we arrive at. */
+void ropeInsert(ssize_t at, erow* row) {
+    if (E.rows == NULL) {
+        E.rows = ropeNewNode(1);
+    }
+    if (ropeIsFull(E.rows)) {
+        ropeNode* root = ropeNewNode(0);
+        root->u.child[0] = E.rows;
+        root->count = 1;
+        root->numrows = E.rows->numrows;
+        E.rows->parent = root;
+        ropeSplitChild(root, 0);
+        E.rows = root;
+    }
+
+    ropeNode* n = E.rows;
+    while (!n->leaf) {
+        int j = 0;
+        while (j < n->count - 1 && at > n->u.child[j]->numrows) {
+            at -= n->u.child[j]->numrows;
+            j++;
+        }
+        if (ropeIsFull(n->u.child[j])) {
+            ropeSplitChild(n, j);
+            if (at > n->u.child[j]->numrows) {
+                at -= n->u.child[j]->numrows;
+                j++;
             }
         }
+        n->numrows++;
+        n = n->u.child[j];
+    }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0;
-                i++;
+    ropeLoadLeaf(n);
+    memmove(&n->u.rows[at + 1], &n->u.rows[at],
+            sizeof(erow*) * (n->count - at));
+    n->u.rows[at] = row;
+    n->count++;
+    n->numrows++;
+    ropeAdopt(n, at);
+}
+
+/* Leaves that drop below a quarter full are folded into a loaded neighbour
+ * with the same parent, empty nodes are unlinked, and the root is collapsed
+ * while it only has one child. */
+void ropeRebalance(ropeNode* n) {
+    ropeNode* p = n->parent;
+    if (p && n->count < ROPE_LEAF_MAX / 4) {
+        ropeNode* prev = n->prev;
+        ropeNode* next = n->next;
+        if (!prev || prev->parent != p || !prev->u.rows) prev = NULL;
+        if (!next || next->parent != p || !next->u.rows) next = NULL;
+        if (prev && prev->count + n->count <= ROPE_LEAF_MAX / 2) {
+            editorMarkMoved(prev);
+            memcpy(&prev->u.rows[prev->count], n->u.rows,
+                   sizeof(erow*) * n->count);
+            prev->count += n->count;
+            prev->numrows += n->count;
+            ropeAdopt(prev, prev->count - n->count);
+            n->count = n->numrows = 0;
+        } else if (next && next->count + n->count <= ROPE_LEAF_MAX / 2) {
+            editorMarkMoved(n);
+            memmove(&next->u.rows[n->count], next->u.rows,
+                    sizeof(erow*) * next->count);
+            memcpy(next->u.rows, n->u.rows, sizeof(erow*) * n->count);
+            next->hlin = n->hlin;
+            next->count += n->count;
+            next->numrows += n->count;
+            ropeAdopt(next, 0);
+            n->count = n->numrows = 0;
+        }
+    }
+
+    while (n->count == 0 && n->parent) {
+        p = n->parent;
+        int j = 0;
+        while (p->u.child[j] != n) {
+            j++;
+        }
+        memmove(&p->u.child[j], &p->u.child[j + 1],
+                sizeof(ropeNode*) * (p->count - j - 1));
+        p->count--;
+        if (n->leaf) {
+            if (n->prev) n->prev->next = n->next;
+            if (n->next) n->next->prev = n->prev;
+        }
+        ropeFreeNode(n);
+        n = p;
+    }
+
+    while (!E.rows->leaf && E.rows->count <= 1) {
+        ropeNode* root = E.rows;
+        E.rows = root->count ? root->u.child[0] : ropeNewNode(1);
+        E.rows->parent = NULL;
+        ropeFreeNode(root);
+    }
+}
+
+// take the row at line `at` out of the tree and hand it back
+erow* ropeRemove(ssize_t at) {
+    ropeNode* n = E.rows;
+    while (!n->leaf) {
+        int j = 0;
+        while (at >= n->u.child[j]->numrows) {
+            at -= n->u.child[j]->numrows;
+            j++;
+        }
+        n->numrows--;
+        n = n->u.child[j];
+    }
+
+    ropeLoadLeaf(n);
+    erow* row = n->u.rows[at];
+    memmove(&n->u.rows[at], &n->u.rows[at + 1],
+            sizeof(erow*) * (n->count - at - 1));
+    n->count--;
+    n->numrows--;
+    ropeAdopt(n, at);
+    ropeRebalance(n);
+    return row;
+}
+
+// leaf holding line *at, which becomes its slot there; the leaf isn't loaded
+ropeNode* ropeLeaf(ssize_t* at) {
+    ropeNode* n = E.rows;
+    if (n == NULL || *at < 0 || *at >= n->numrows) {
+        return NULL;
+    }
+    while (!n->leaf) {
+        int j = 0;
+        while (*at >= n->u.child[j]->numrows) {
+            *at -= n->u.child[j]->numrows;
+            j++;
+        }
+        n = n->u.child[j];
+    }
+    return n;
+}
+
+// row at line `at`, or NULL past the end of the file
+erow* editorRow(ssize_t at) {
+    ropeNode* n = ropeLeaf(&at);
+    if (n == NULL) {
+        return NULL;
+    }
+    ropeLoadLeaf(n);
+    return n->u.rows[at];
+}
+
+// line number of a row, found by walking up from its leaf
+ssize_t editorRowIndex(erow* row) {
+    return ropeLine(row->leaf) + row->slot;
+}
+
+erow* editorRowNext(erow* row) {
+    ropeNode* n = row->leaf;
+    if (row->slot + 1 < n->count) {
+        return n->u.rows[row->slot + 1];
+    }
+    if (n->next == NULL) {
+        return NULL;
+    }
+    ropeLoadLeaf(n->next);
+    return n->next->u.rows[0];
+}
+
+erow* editorRowPrev(erow* row) {
+    ropeNode* n = row->leaf;
+    if (row->slot > 0) {
+        return n->u.rows[row->slot - 1];
+    }
+    if (n->prev == NULL) {
+        return NULL;
+    }
+    ropeLoadLeaf(n->prev);
+    return n->prev->u.rows[n->prev->count - 1];
+}
+
+/*+++ syntax highlighting +++*/
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+unsigned int syntaxHash(const char* s, int len) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    for (int j = 0; j < len; j++) {
+        h = (h ^ (unsigned char)s[j]) * 16777619u;
+    }
+    return h;
+}
+
+struct syntaxLexer* syntaxCompile(struct editorSyntax* s) {
+    struct syntaxLexer* lx = calloc(1, sizeof(struct syntaxLexer));
+    if (lx == NULL) {
+        die("calloc");
+    }
+    char* scs = s->singleline_comment_start;
+    char* mcs = s->multiline_comment_start;
+    char* mce = s->multiline_comment_end;
+    lx->scs_len = scs ? strlen(scs) : 0;
+    lx->mcs_len = mcs ? strlen(mcs) : 0;
+    lx->mce_len = mce ? strlen(mce) : 0;
+    // a multi line comment needs both ends to be recognised
+    if (lx->mcs_len == 0 || lx->mce_len == 0) {
+        lx->mcs_len = lx->mce_len = 0;
+    }
+
+    for (int c = 0; c < 256; c++) {
+        if (is_separator(c < 128 ? c : c - 256)) lx->cls[c] |= LEX_SEP;
+        if (isdigit(c)) lx->cls[c] |= LEX_DIGIT;
+    }
+    if (s->flags & HL_HIGHLIGHT_STRINGS) {
+        lx->cls['"'] |= LEX_QUOTE;
+        lx->cls['\''] |= LEX_QUOTE;
+    }
+    if (lx->scs_len) lx->cls[(unsigned char)scs[0]] |= LEX_SCS;
+    if (lx->mcs_len) lx->cls[(unsigned char)mcs[0]] |= LEX_MCS;
+    if (lx->mce_len) lx->cls[(unsigned char)mce[0]] |= LEX_MCE;
+
+    // a string escape looks one char ahead, delimiters their own length
+    lx->look = 2;
+    if (lx->scs_len > lx->look) lx->look = lx->scs_len;
+    if (lx->mcs_len > lx->look) lx->look = lx->mcs_len;
+    if (lx->mce_len > lx->look) lx->look = lx->mce_len;
+
+    int nkw = 0;
+    while (s->keywords[nkw]) {
+        nkw++;
+    }
+    unsigned int size = 16;
+    while (size < (unsigned int)nkw * 2) {
+        size *= 2;
+    }
+    lx->kwmask = size - 1;
+    lx->kw = calloc(size, sizeof(struct syntaxKeyword));
+    if (lx->kw == NULL) {
+        die("calloc");
+    }
+    for (int j = 0; j < nkw; j++) {
+        const char* word = s->keywords[j];
+        int len = strlen(word);
+        int kw2 = len > 0 && word[len - 1] == '|';
+        if (kw2) len--;
+        if (len == 0) continue;
+        // a keyword needs a separator after it, so it is a lookahead too
+        if (len + 1 > lx->look) lx->look = len + 1;
+        if (len > lx->maxkw) lx->maxkw = len;
+        lx->cls[(unsigned char)word[0]] |= LEX_WORD;
+
+        unsigned int h = syntaxHash(word, len) & lx->kwmask;
+        while (lx->kw[h].word &&
+               !(lx->kw[h].len == len && !memcmp(lx->kw[h].word, word, len))) {
+            h = (h + 1) & lx->kwmask;
+        }
+        if (lx->kw[h].word == NULL) {  // the first definition of a word wins
+            lx->kw[h].word = word;
+            lx->kw[h].len = len;
+            lx->kw[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+    return lx;
+}
+
+/* Highlight of the keyword that is the word at s, which ends at a separator
+ * like the NUL after render does, with its length in *len; 0 if it is not
+ * one. */
+unsigned char syntaxKeyword(const struct syntaxLexer* lx, const char* s,
+                            int* len) {
+    int n = 0;
+    while (!(lx->cls[(unsigned char)s[n]] & LEX_SEP)) {
+        if (++n > lx->maxkw) {
+            return 0;
+        }
+    }
+    unsigned int h = syntaxHash(s, n) & lx->kwmask;
+    while (lx->kw[h].word) {
+        if (lx->kw[h].len == n && !memcmp(lx->kw[h].word, s, n)) {
+            *len = n;
+            return lx->kw[h].hl;
+        }
+        h = (h + 1) & lx->kwmask;
+    }
+    return 0;
+}
+
+/* Run the highlighter over render[i, rsize) in the given lexer state and
+ * return the comment state at the end. With `converge` >= 0 it stops at the
+ * first position past it where both the old and the new hl are back in plain
+ * code and returns -1: from there on the row lexes exactly as before, so the
+ * rest of hl stands. Touches nothing but hl, the worker thread runs it too. */
+int syntaxLex(const struct editorSyntax* syn, const char* render,
+              ssize_t rsize, unsigned char* hl, ssize_t i, int in_comment,
+              int prev_sep, ssize_t converge) {
+    const struct syntaxLexer* lx = syn->lexer;
+    const unsigned char* cls = lx->cls;
+    const char* scs = syn->singleline_comment_start;
+    const char* mcs = syn->multiline_comment_start;
+    const char* mce = syn->multiline_comment_end;
+    int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+
+    int in_string = 0;
+    ssize_t seen = -1;  // last position whose old hl we looked at
+    unsigned char seen_hl = HL_NORMAL;
+
+    while (i < rsize) {
+        if (converge >= 0 && i >= converge && seen == i - 1 &&
+            seen_hl == HL_NORMAL && hl[i - 1] == HL_NORMAL && !in_string &&
+            !in_comment) {
+            return -1;
+        }
+        seen = i;
+        seen_hl = hl[i];
+
+        char c = render[i];
+        unsigned char k = cls[(unsigned char)c];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        if (in_comment) {
+            if ((k & LEX_MCE) && !strncmp(&render[i], mce, lx->mce_len)) {
+                memset(&hl[i], HL_MLCOMMENT, lx->mce_len);
+                i += lx->mce_len;
+                in_comment = 0;
                 prev_sep = 1;
-                continue;
             } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
+                hl[i++] = HL_MLCOMMENT;
             }
+            continue;
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
+        if (in_string) {
+            hl[i] = HL_STRING;
+            if (c == '\\' && i + 1 < rsize) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
                 continue;
             }
+            if (c == in_string) in_string = 0;
+            i++;
+            prev_sep = 1;
+            continue;
         }
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+        if ((k & LEX_SCS) && !strncmp(&render[i], scs, lx->scs_len)) {
+            memset(&hl[i], HL_COMMENT, rsize - i);
+            break;
+        }
+
+        if ((k & LEX_MCS) && !strncmp(&render[i], mcs, lx->mcs_len)) {
+            memset(&hl[i], HL_MLCOMMENT, lx->mcs_len);
+            i += lx->mcs_len;
+            in_comment = 1;
+            continue;
+        }
+
+        if (k & LEX_QUOTE) {
+            in_string = c;
+            hl[i++] = HL_STRING;
+            continue;
+        }
+
+        if (numbers &&
+            (((k & LEX_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+             (c == '.' && prev_hl == HL_NUMBER))) {
+            hl[i++] = HL_NUMBER;
+            prev_sep = 0;
+            continue;
+        }
+
+        if (prev_sep && (k & LEX_WORD)) {
+            int len;
+            unsigned char kw = syntaxKeyword(lx, &render[i], &len);
+            if (kw) {
+                memset(&hl[i], kw, len);
+                i += len;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        prev_sep = is_separator(c);
-        i++;
-    }
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
-}
-
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT:
-            return 36;
-        case HL_KEYWORD1:
-            return 33;
-        case HL_KEYWORD2:
-            return 32;
-        case HL_STRING:
-            return 35;
-        case HL_NUMBER:
-            return 31;
-        case HL_MATCH:
-            return 34;
-        default:
-            return 37;
+        hl[i++] = HL_NORMAL;
+        prev_sep = k & LEX_SEP;
     }
+    return in_comment;
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
-    char* ext = strrchr(E.filename, '.');
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax* s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                return;
-            }
-            i++;
+// scratch room for a hl of `size` columns
+unsigned char* editorHlScratch(ssize_t size) {
+    if ((size_t)size >= E.hlbufcap) {
+        E.hlbufcap = size * 2 + 64;
+        E.hlbuf = realloc(E.hlbuf, E.hlbufcap);
+        if (E.hlbuf == NULL) {
+            die("realloc");
         }
     }
+    return E.hlbuf;
+}
+
+/* The spans of a row spelled out in the scratch, a byte per column and at
+ * least `size` of them. Good until the scratch is used again. */
+unsigned char* editorRowHl(erow* row, ssize_t size) {
+    if (size < row->rsize) {
+        size = row->rsize;
+    }
+    unsigned char* hl = editorHlScratch(size);
+    ssize_t at = 0;
+    for (ssize_t i = 0; i < row->nspans; i++) {
+        ssize_t len = HL_SPAN_LEN(row->hl[i]);
+        memset(&hl[at], HL_SPAN_HL(row->hl[i]), len);
+        at += len;
+    }
+    memset(&hl[at], HL_NORMAL, size - at);
+    return hl;
+}
+
+void editorRowClearHl(erow* row) {
+    arenaFree(row->hl, row->hlcap, row->nspans * sizeof(hlSpan));
+    row->hl = NULL;
+    row->nspans = 0;
+    row->hlcap = 0;
+}
+
+// store the rsize columns of `hl` as the spans of the row
+void editorRowSetHl(erow* row, const unsigned char* hl) {
+    ssize_t end = row->rsize;
+    while (end > 0 && hl[end - 1] == HL_NORMAL) {
+        end--;
+    }
+    ssize_t n = 0;
+    for (ssize_t i = 0, j; i < end; i = j, n++) {
+        for (j = i + 1; j < end && hl[j] == hl[i] && j - i < HL_SPAN_MAX; j++)
+            ;
+    }
+    if (n == 0) {
+        editorRowClearHl(row);
+        return;
+    }
+    size_t oldsize = row->nspans * sizeof(hlSpan);
+    row->hl = arenaRealloc(row->hl, &row->hlcap, oldsize, n * sizeof(hlSpan));
+    row->nspans = n;
+    n = 0;
+    for (ssize_t i = 0, j; i < end; i = j) {
+        for (j = i + 1; j < end && hl[j] == hl[i] && j - i < HL_SPAN_MAX; j++)
+            ;
+        row->hl[n++] = HL_SPAN(hl[i], j - i);
+    }
+}
+
+/* Comment state the row in `slot` of leaf n is lexed from, or -1 if it is
+ * not known yet. For the first row that is the checkpoint of the leaf. A
+ * stale row above, such as one in a leaf loaded after the worker went past,
+ * is highlighted first; that also fills in a missing checkpoint. */
+int ropeInState(ropeNode* n, int slot) {
+    erow* prev;
+    if (slot > 0) {
+        prev = n->u.rows[slot - 1];
+    } else if (n->hlin >= 0) {
+        return n->hlin;
+    } else if (n->prev == NULL) {
+        return 0;
+    } else if (n->prev->u.rows) {
+        prev = n->prev->u.rows[n->prev->count - 1];
+    } else {
+        return -1;  // the worker has yet to lex the leaf before
+    }
+    if (prev->stale & ROW_STALE_HL) {
+        editorLeafHighlight(prev);
+    }
+    return (prev->stale & ROW_STALE_HL) ? -1 : prev->hl_open_comment;
+}
+
+/* The line before leaf n now ends in `state`. If the leaf was lexed from
+ * another one, the checkpoint moves and the leaf is stale again. A change
+ * travels down the file this way one leaf at a time, so the checkpoints past
+ * the point where it dies out are never touched. Returns 1 if it moved. */
+int ropeSetIn(ropeNode* n, int state) {
+    if (n->hlin == state) {
+        return 0;
+    }
+    n->hlin = state;
+    if (n->u.rows) {
+        n->u.rows[0]->stale |= ROW_STALE_HL;
+    } else {
+        n->stale |= ROW_STALE_HL;
+    }
+    return 1;
+}
+
+/* Lex row->render from position `i` on into `hl`, the hl of the row a byte
+ * per column, see syntaxLex, and keep the result as the spans of the row. */
+void editorHighlightFrom(erow* row, unsigned char* hl, ssize_t i,
+                         int in_comment, int prev_sep, ssize_t converge) {
+    in_comment = syntaxLex(E.syntax, row->render, row->rsize, hl, i,
+                           in_comment, prev_sep, converge);
+    editorRowSetHl(row, hl);
+    if (in_comment < 0) {
+        return;
+    }
+    ropeNode* leaf = row->leaf;
+    int changed = row->hl_open_comment != in_comment;
+    row->hl_open_comment = in_comment;
+    /* The row below was lexed from the old state. Rather than following the
+     * change down the file here, mark it stale and move the watermark: the
+     * walk in editorRowHighlight goes only as far as the screen needs and
+     * the worker thread does the rest. The last row of a leaf hands its state
+     * to the checkpoint of the next leaf instead. */
+    if (row->slot + 1 == leaf->count) {
+        changed = leaf->next && ropeSetIn(leaf->next, in_comment);
+    } else if (changed) {
+        leaf->u.rows[row->slot + 1]->stale |= ROW_STALE_HL;
+    }
+    if (changed) {
+        editorMarkStale(editorRowIndex(row) + 1);
+    }
+}
+
+void editorUpdateSyntax(erow* row) {
+    editorRowRender(row);
+    if (E.syntax == NULL) {
+        row->stale &= ~ROW_STALE_HL;
+        editorRowClearHl(row);
+        return;
+    }
+    // getting the state may highlight rows above through the same scratch
+    int in = ropeInState(row->leaf, row->slot);
+    if (in < 0) {
+        return;  // left plain and stale, there is nothing to lex it from
+    }
+    row->stale &= ~ROW_STALE_HL;
+    editorHighlightFrom(row, editorHlScratch(row->rsize), 0, in, 1, -1);
+}
+
+// how far past its start the highlighter may look to decide on a token
+int editorSyntaxLookahead() { return E.syntax->lexer->look; }
+
+/* Bring hl up to date after render changed in [from, to) and everything
+ * after `to` only moved. Lexing restarts at plain code at least a lookahead
+ * before the edit and stops once it converges again after it. */
+void editorRowRehighlight(erow* row, ssize_t from, ssize_t to) {
+    if ((row->stale & ROW_STALE_HL) || E.syntax == NULL) {
+        return;
+    }
+    int in = ropeInState(row->leaf, row->slot);  // before the scratch is ours
+    if (in < 0) {
+        editorRowClearHl(row);
+        row->stale |= ROW_STALE_HL;
+        return;
+    }
+    unsigned char* hl = editorRowHl(row, row->rsize);
+    int look = editorSyntaxLookahead();
+    ssize_t start = from - look;
+    if (start < 0) {
+        start = 0;
+    }
+    while (start > 0 && hl[start - 1] != HL_NORMAL) {
+        start--;
+    }
+    if (start == 0) {
+        editorHighlightFrom(row, hl, 0, in, 1, to + look);
+    } else {
+        editorHighlightFrom(
+            row, hl, start, 0,
+            E.syntax->lexer->cls[(unsigned char)row->render[start - 1]] &
+                LEX_SEP,
+            to + look);
+    }
+}
+
+/* Highlight the stale rows of row's leaf up to `row`, starting from the
+ * checkpoint of the leaf. Above the watermark the checkpoint is right. Below
+ * it, it is the state the line before ended in when it was last lexed, which
+ * holds unless an edit further up is still on its way down; the worker lexes
+ * the rows again if the state it brings differs. Without a checkpoint the
+ * rows stay stale and `row` is only rendered, until the worker comes. */
+void editorLeafHighlight(erow* row) {
+    ropeNode* n = row->leaf;
+    for (int j = 0; j <= row->slot; j++) {
+        erow* r = n->u.rows[j];
+        if (r->stale & ROW_STALE_HL) {
+            editorUpdateSyntax(r);
+        }
+        if (r->stale & ROW_STALE_HL) {
+            editorRowRender(row);
+            return;
+        }
+    }
+}
+
+/* Make sure the row at line `at` has an up to date hl. A row is highlighted
+ * from the comment state of the row above it, so stale rows between the
+ * watermark and `at` are highlighted first, in order. When that is more than
+ * the screen can wait for, the row is highlighted from the checkpoint of its
+ * leaf instead. So is a stale row above the watermark, whose leaf was loaded
+ * after the worker lexed it from the mapping. */
+void editorRowHighlight(erow* row, ssize_t at) {
+    if (at < E.hlstale && !(row->stale & ROW_STALE_HL)) {
+        return;
+    }
+    if (E.syntax == NULL) {
+        editorRowRender(row);
+        return;
+    }
+    if (at < E.hlstale || at - E.hlstale > HL_SYNC_ROWS) {
+        editorLeafHighlight(row);
+        return;
+    }
+    erow* r = (at == E.hlstale) ? row : editorRow(E.hlstale);
+    for (ssize_t i = E.hlstale; i <= at; i++) {
+        if (r->stale & ROW_STALE_HL) {
+            editorUpdateSyntax(r);
+        }
+        if (r->stale & ROW_STALE_HL) {
+            editorRowRender(row);  // the watermark stays where it can't go on
+            return;
+        }
+        if (i < at) {
+            r = editorRowNext(r);
+        }
+    }
+    E.hlstale = at + 1;
+}
+
+// keep the batch from being published from line `at` on
+void hlCut(struct hlJob* job, ssize_t at) {
+    if (job->running && at - job->start < job->valid) {
+        job->valid = (at < job->start) ? 0 : at - job->start;
+    }
+}
+
+// a row at line `at` changed, so its hl and everything after it may be stale
+void editorMarkStale(ssize_t at) {
+    if (at < E.hlstale) {
+        E.hlstale = at;
+    }
+    hlCut(&E.hl, at);
+}
+
+/* Rows of `leaf` are about to move into another leaf, or rows of another
+ * into it. A whole leaf entry for it would no longer be the rows it was
+ * lexed from, so the batch is cut at its first line. */
+void editorMarkMoved(ropeNode* leaf) {
+    if (E.hl.running) {
+        hlCut(&E.hl, ropeLine(leaf));
+    }
+}
+
+/* Lex the lines of an unloaded leaf where they are in the mapping and return
+ * the state the last one ends in. Their hl goes to a scratch buffer. */
+int hlLexMapped(struct hlJob* job, const char* p, ssize_t lines, int in) {
+    const char* end = E.map + E.maplen;  // fixed while a batch is out
+    for (ssize_t j = 0; j < lines; j++) {
+        ssize_t len;
+        const char* next = ropeMapLine(p, &len);
+        if ((size_t)len + 1 > job->scratchcap) {
+            job->scratchcap = (len + 1) * 2;
+            job->scratch = realloc(job->scratch, job->scratchcap);
+            job->scratchhl = realloc(job->scratchhl, job->scratchcap);
+            if (job->scratch == NULL || job->scratchhl == NULL) {
+                die("realloc");
+            }
+        }
+        const char* text = p;
+        if (p + len == end) {
+            // nothing after the last line stops the lexer looking ahead
+            memcpy(job->scratch, p, len);
+            job->scratch[len] = '\0';
+            text = job->scratch;
+        }
+        in = syntaxLex(job->syntax, text, len, job->scratchhl, 0, in, 1, -1);
+        p = next;
+    }
+    return in;
+}
+
+void* hlThread(void* arg) {
+    struct hlJob* job = arg;
+    int in = job->in;
+    int changed = 0;  // the entry above ended in another state than before
+    for (ssize_t i = 0; i < job->nrows; i++) {
+        struct hlEntry* e = &job->rows[i];
+        if (e->stale || changed) {
+            int open = e->row ? syntaxLex(job->syntax, job->text + e->off,
+                                          e->rsize, job->hl + e->off, 0, in,
+                                          1, -1)
+                              : hlLexMapped(job, e->map, e->lines, in);
+            changed = (open != e->open);
+            e->open = open;
+            e->lexed = 1;
+        }
+        in = e->open;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/* Copy the rows from the watermark on into the next batch, returns 0 if there
+ * is nothing to do. Rows that are not stale were lexed from the state the row
+ * above still ends in, so the watermark just moves past them, and so it does
+ * past unloaded leaves that were already lexed from their checkpoint. Other
+ * unloaded leaves go into the batch as a whole and are lexed in the mapping,
+ * which fills in the checkpoint of the leaf after them. */
+int hlSnapshot(struct hlJob* job) {
+    if (E.syntax == NULL) {
+        return 0;
+    }
+    job->nrows = 0;
+    size_t used = 0;
+    ssize_t lines = 0;
+    ropeNode* n = NULL;
+    ssize_t slot = 0;
+    while (E.hlstale + lines < E.numrows && lines < HL_BATCH_ROWS &&
+           used < HL_BATCH_BYTES) {
+        if (n == NULL) {
+            slot = E.hlstale + lines;
+            n = ropeLeaf(&slot);
+        } else if (slot == n->count) {
+            n = n->next;
+            slot = 0;
+        }
+        if (n->u.rows == NULL && slot > 0) {
+            ropeLoadLeaf(n);  // the watermark stopped inside of it
+        }
+        erow* row = n->u.rows ? n->u.rows[slot] : NULL;
+        ssize_t count = row ? 1 : n->count;
+        int stale = (row ? row->stale : n->stale) & ROW_STALE_HL;
+        // the state the entry ended in, as the line after it was lexed from
+        int open = row ? row->hl_open_comment : 0;
+        if (slot + count == n->count && n->next) {
+            open = n->next->hlin;
+        }
+        if (open < 0) {
+            stale = 1;
+        }
+        if (job->nrows == 0 && !stale) {
+            E.hlstale += count;
+            slot += count;
+            continue;
+        }
+
+        if (job->nrows == 0) {
+            // this may highlight rows above, which can move the watermark
+            ssize_t at = E.hlstale;
+            job->in = ropeInState(n, slot);
+            if (E.hlstale != at) {
+                n = NULL;
+                continue;
+            }
+            if (job->in < 0) {
+                return 0;
+            }
+        }
+        if (job->nrows == job->rowcap) {
+            job->rowcap = job->rowcap ? job->rowcap * 2 : 1024;
+            job->rows =
+                realloc(job->rows, sizeof(struct hlEntry) * job->rowcap);
+            if (job->rows == NULL) die("realloc");
+        }
+        struct hlEntry* e = &job->rows[job->nrows++];
+        e->row = row;
+        e->leaf = n;
+        e->line = lines;
+        e->lines = count;
+        e->stale = stale;
+        e->open = open;
+        e->lexed = 0;
+        if (row) {
+            editorRowRender(row);
+            // each row ends in a nul, which stops the lexer looking ahead
+            if (used + row->rsize + 1 > job->textcap) {
+                job->textcap = (used + row->rsize + 1) * 2;
+                job->text = realloc(job->text, job->textcap);
+                job->hl = realloc(job->hl, job->textcap);
+                if (job->text == NULL || job->hl == NULL) die("realloc");
+            }
+            e->version = row->version;
+            e->off = used;
+            e->rsize = row->rsize;
+            memcpy(job->text + used, row->render, row->rsize);
+            job->text[used + row->rsize] = '\0';
+            used += row->rsize + 1;
+        } else {
+            e->map = n->map;
+        }
+        lines += count;
+        slot += count;
+    }
+    if (job->nrows == 0) {
+        return 0;
+    }
+    job->start = E.hlstale;
+    job->valid = lines;
+    job->syntax = E.syntax;
+    job->done = 0;
+    return 1;
+}
+
+/* Copy the hl the worker found back into the rows of the batch and the state
+ * at the end of each leaf into the checkpoint of the next one, as far as no
+ * edit has touched them since. Returns 1 if any of them is on the screen. */
+int hlPublish(struct hlJob* job) {
+    ssize_t lines = 0;
+    erow* changed = NULL;  // last row, if the row below it is stale now
+    for (ssize_t k = 0; k < job->nrows; k++) {
+        struct hlEntry* e = &job->rows[k];
+        erow* row = e->row;
+        if (e->line + e->lines > job->valid ||
+            (row && row->version != e->version)) {
+            break;
+        }
+        changed = NULL;
+        // edits since may have split or freed the leaf a row was in
+        ropeNode* leaf = row ? row->leaf : e->leaf;
+        if (row == NULL && leaf->u.rows) {
+            // loaded while the batch was out, maybe highlighted from a state
+            // that was not known yet
+            for (int j = 0; j < leaf->count; j++) {
+                leaf->u.rows[j]->stale |= ROW_STALE_HL;
+            }
+        } else if (row == NULL) {
+            leaf->stale &= ~ROW_STALE_HL;
+        } else if (e->lexed) {
+            if (row->hl_open_comment != e->open) {
+                changed = row;
+            }
+            editorRowSetHl(row, job->hl + e->off);
+            row->hl_open_comment = e->open;
+            row->stale &= ~ROW_STALE_HL;
+        }
+        if (row == NULL || row->slot + 1 == leaf->count) {
+            if (leaf->next) {
+                ropeSetIn(leaf->next, e->open);
+            }
+            changed = NULL;
+        }
+        lines = e->line + e->lines;
+    }
+    if (lines == 0) {
+        return 0;
+    }
+    if (changed) {
+        changed->leaf->u.rows[changed->slot + 1]->stale |= ROW_STALE_HL;
+    }
+    if (job->start + lines > E.hlstale) {
+        E.hlstale = job->start + lines;
+    }
+    return job->start < E.rowoff + E.screenrows &&
+           job->start + lines > E.rowoff;
+}
+
+/* Collect a finished batch and start the next one, returns 1 if the screen
+ * changed. */
+int editorHighlightPoll() {
+    struct hlJob* job = &E.hl;
+    int redraw = 0;
+    if (job->running) {
+        pthread_mutex_lock(&job->lock);
+        int done = job->done;
+        pthread_mutex_unlock(&job->lock);
+        if (!done) {
+            return 0;
+        }
+        pthread_join(job->thread, NULL);
+        job->running = 0;
+        redraw = hlPublish(job);
+    }
+    if (hlSnapshot(job)) {
+        if (pthread_create(&job->thread, NULL, hlThread, job) == 0) {
+            job->running = 1;
+        } else {
+            hlThread(job);  // lex it here then
+            redraw |= hlPublish(job);
+        }
+    }
+    return redraw;
+}
+
+// wait for the worker and drop the batch, its rows are about to go away
+void editorHighlightCancel() {
+    if (E.hl.running) {
+        pthread_join(E.hl.thread, NULL);
+        E.hl.running = 0;
+    }
+}
+
+// the escape that sets the color of each highlight, all of the same length
+const char* hlEscape[] = {
+    [HL_NORMAL] = "\x1b[39m",   [HL_COMMENT] = "\x1b[36m",
+    [HL_MLCOMMENT] = "\x1b[36m", [HL_KEYWORD1] = "\x1b[33m",
+    [HL_KEYWORD2] = "\x1b[32m",  [HL_STRING] = "\x1b[35m",
+    [HL_NUMBER] = "\x1b[31m",    [HL_MATCH] = "\x1b[34m",
+};
+#define HL_ESCAPE_LEN 5
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    if (E.filename == NULL) return;
+    char* ext = strrchr(E.filename, '.');
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax* s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                if (s->lexer == NULL) {
+                    s->lexer = syntaxCompile(s);
+                }
+                E.syntax = s;
+                for (ropeNode* n = ropeFirstLeaf(); n; n = n->next) {
+                    n->hlin = -1;
+                    n->stale |= ROW_STALE_HL;
+                    for (int k = 0; n->u.rows && k < n->count; k++) {
+                        n->u.rows[k]->stale |= ROW_STALE_HL;
+                    }
+                }
+                editorMarkStale(0);
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*+++ row operations +++*/
+
+/* The chars of a row are a gap buffer: chars[0, gap) holds the text before
+ * the gap and the rest of the text sits at the very end of the ccap sized
+ * block, with the free space in between. Edits happen at the gap, which
+ * follows the cursor, so typing never shifts the rest of a long line. */
+
+// text after the gap, size - gap chars long
+char* editorRowTail(erow* row) {
+    return row->chars + row->ccap - (row->size - row->gap);
+}
+
+// move the gap so that it starts at char `at`
+void editorRowMoveGap(erow* row, ssize_t at) {
+    char* tail = editorRowTail(row);
+    if (at < row->gap) {
+        memmove(tail - (row->gap - at), &row->chars[at], row->gap - at);
+    } else if (at > row->gap) {
+        memmove(&row->chars[row->gap], tail, at - row->gap);
+    }
+    row->gap = at;
+}
+
+// a block with room for at least `size` chars, requested at its full class
+char* editorAllocChars(ssize_t size, size_t* cap) {
+    arenaClass(size, cap);
+    return arenaAlloc(*cap, cap);
+}
+
+// make room for `extra` more chars, moving to a bigger block if needed
+void editorRowReserve(erow* row, ssize_t extra) {
+    if ((size_t)(row->size + extra) <= row->ccap) {
+        return;
+    }
+    size_t cap;
+    char* chars = editorAllocChars(row->size + extra, &cap);
+    ssize_t taillen = row->size - row->gap;
+    memcpy(chars, row->chars, row->gap);
+    memcpy(chars + cap - taillen, editorRowTail(row), taillen);
+    arenaFree(row->chars, row->ccap, row->ccap);
+    row->chars = chars;
+    row->ccap = cap;
+}
+
+/* Render `len` chars starting at render column `rx`, into `render` when it
+ * is not NULL, and return the column after them. */
+ssize_t editorRenderSpan(char* render, const char* s, ssize_t len,
+                         ssize_t rx) {
+    // copy the runs between tabs whole, memchr finds the tabs
+    const char* end = s + len;
+    while (s < end) {
+        const char* tab = memchr(s, '\t', end - s);
+        ssize_t run = (tab ? tab : end) - s;
+        if (render) {
+            memcpy(&render[rx], s, run);
+        }
+        rx += run;
+        if (tab == NULL) {
+            break;
+        }
+        ssize_t stop = (rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+        if (render) {
+            memset(&render[rx], ' ', stop - rx);
+        }
+        rx = stop;
+        s = tab + 1;
+    }
+    return rx;
+}
+
+// add the tabs of `len` chars at char index cx and render column rx
+ssize_t editorRowIndexTabs(erow* row, const char* s, ssize_t len, ssize_t cx,
+                           ssize_t rx) {
+    const char* end = s + len;
+    const char* tab;
+    while ((tab = memchr(s, '\t', end - s)) != NULL) {
+        rx += tab - s;
+        cx += tab - s;
+        size_t need = (row->ntabs + 1) * sizeof(struct rowTab);
+        if (need > row->tabcap) {
+            row->tabs = arenaRealloc(row->tabs, &row->tabcap,
+                                     row->ntabs * sizeof(struct rowTab), need);
+        } else {
+            E.arena.requested += sizeof(struct rowTab);
+        }
+        row->tabs[row->ntabs].cx = cx;
+        row->tabs[row->ntabs].rx = rx;
+        row->ntabs++;
+        rx = (rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+        cx++;
+        s = tab + 1;
+    }
+    return rx + (end - s);
+}
+
+/* Rebuild the list of tabs of a row after its chars changed. Between two
+ * tabs cx and rx move in step, so with the list a column is found by binary
+ * search instead of a walk from the start of the line. */
+void editorRowTabs(erow* row) {
+    if (!(row->stale & ROW_STALE_TABS)) {
+        return;
+    }
+    E.arena.requested -= row->ntabs * sizeof(struct rowTab);
+    row->ntabs = 0;
+    ssize_t rx = editorRowIndexTabs(row, row->chars, row->gap, 0, 0);
+    editorRowIndexTabs(row, editorRowTail(row), row->size - row->gap,
+                       row->gap, rx);
+    row->stale &= ~ROW_STALE_TABS;
+}
+
+ssize_t editorRowCxToRx(erow* row, ssize_t cx) {
+    editorRowTabs(row);
+    // last tab before cx
+    ssize_t lo = 0;
+    ssize_t hi = row->ntabs;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].cx < cx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return cx;
+    }
+    struct rowTab* t = &row->tabs[lo - 1];
+    return (t->rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP + (cx - t->cx - 1);
+}
+
+ssize_t editorRowRxToCx(erow* row, ssize_t rx) {
+    editorRowTabs(row);
+    // last tab starting at or before rx
+    ssize_t lo = 0;
+    ssize_t hi = row->ntabs;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].rx <= rx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    ssize_t cx = rx;
+    if (lo > 0) {
+        struct rowTab* t = &row->tabs[lo - 1];
+        ssize_t stop = (t->rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+        cx = (rx < stop) ? t->cx : t->cx + 1 + (rx - stop);
+    }
+    return cx < row->size ? cx : row->size;
+}
+
+// rebuild the render of a row if its chars changed since the last one
+void editorRowRender(erow* row) {
+    if (!(row->stale & ROW_STALE_RENDER)) {
+        return;
+    }
+    char* tail = editorRowTail(row);
+    ssize_t taillen = row->size - row->gap;
+    ssize_t rsize = editorRenderSpan(NULL, row->chars, row->gap, 0);
+    rsize = editorRenderSpan(NULL, tail, taillen, rsize);
+
+    ssize_t oldrsize = row->rsize;
+    row->render = arenaRealloc(row->render, &row->rcap,
+                               row->render ? oldrsize + 1 : 0, rsize + 1);
+    ssize_t rx = editorRenderSpan(row->render, row->chars, row->gap, 0);
+    editorRenderSpan(row->render, tail, taillen, rx);
+    row->render[rsize] = '\0';
+    row->rsize = rsize;
+    editorRowClearHl(row);  // plain until the row is highlighted
+    row->stale &= ~ROW_STALE_RENDER;
+    row->version++;
+}
+
+// the chars of a row changed, render and hl are rebuilt when next needed
+void editorUpdateRow(erow* row) {
+    row->stale |= ROW_STALE_RENDER | ROW_STALE_HL | ROW_STALE_TABS;
+    editorMarkStale(editorRowIndex(row));
+}
+
+/* Patch render and hl after an edit right in front of the gap: the `n` chars
+ * before the gap are new and start at render column `rx`, where `oldw`
+ * columns used to be. The text up to the next tab slides over by the
+ * difference, and past that tab the row only moves if the tab crossed a tab
+ * stop, so the rest of render and hl is moved in one piece and only the
+ * stretch around the edit is highlighted again. */
+void editorRowSplice(erow* row, ssize_t rx, ssize_t oldw, ssize_t n) {
+    row->stale |= ROW_STALE_TABS;
+    if (row->stale & ROW_STALE_RENDER) {
+        return;
+    }
+    char* ins = &row->chars[row->gap - n];
+    char* tail = editorRowTail(row);
+    ssize_t taillen = row->size - row->gap;
+    char* tab = memchr(tail, '\t', taillen);
+    ssize_t m = tab ? tab - tail : taillen;
+
+    ssize_t oldmid = rx + oldw;
+    ssize_t newmid = editorRenderSpan(NULL, ins, n, rx);
+    ssize_t oldtab = oldmid + m;
+    ssize_t newtab = newmid + m;
+    ssize_t oldend = oldtab;
+    ssize_t newend = newtab;
+    if (tab) {
+        oldend = (oldtab / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+        newend = (newtab / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    }
+
+    ssize_t oldrsize = row->rsize;
+    ssize_t rsize = oldrsize + newend - oldend;
+    unsigned char* hl = editorRowHl(row, rsize);
+    unsigned char tabhl = tab ? hl[oldtab] : HL_NORMAL;
+    if (rsize > oldrsize) {
+        row->render = arenaRealloc(row->render, &row->rcap, oldrsize + 1,
+                                   rsize + 1);
+        memmove(&row->render[newend], &row->render[oldend],
+                oldrsize - oldend);
+        memmove(&hl[newend], &hl[oldend], oldrsize - oldend);
+    }
+    memmove(&row->render[newmid], &row->render[oldmid], m);
+    memmove(&hl[newmid], &hl[oldmid], m);
+    if (rsize <= oldrsize) {
+        memmove(&row->render[newend], &row->render[oldend],
+                oldrsize - oldend);
+        memmove(&hl[newend], &hl[oldend], oldrsize - oldend);
+        row->render = arenaRealloc(row->render, &row->rcap, oldrsize + 1,
+                                   rsize + 1);
+    }
+
+    editorRenderSpan(row->render, ins, n, rx);
+    memset(&hl[rx], HL_NORMAL, newmid - rx);
+    memset(&row->render[newtab], ' ', newend - newtab);
+    memset(&hl[newtab], tabhl, newend - newtab);
+    row->render[rsize] = '\0';
+    row->rsize = rsize;
+    editorRowSetHl(row, hl);
+
+    row->version++;
+    editorRowRehighlight(row, rx, newmid);
+}
+
+void editorInsertRow(ssize_t at, char* s, size_t len) {
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
+    erow* row = editorNewRow(NULL, len, 0);
+    row->chars = editorAllocChars(len, &row->ccap);
+    memcpy(row->chars, s, len);
+
+    ropeInsert(at, row);
+    editorMarkStale(at);
+
+    // the row below now follows a different comment state
+    erow* next = editorRowNext(row);
+    if (next) {
+        next->stale |= ROW_STALE_HL;
+    }
+
+    E.numrows++;
+    E.dirty++;
+}
+
+// the running save still reads the chars of this row
+int editorRowShared(erow* row) {
+    return E.save.running && row->savegen == E.save.gen && !row->mapped;
+}
+
+// leave the chars block of a shared row to the save until it is done
+void editorRowOrphanChars(erow* row) {
+    struct saveJob* job = &E.save;
+    if (job->norphans == job->orphcap) {
+        job->orphcap = job->orphcap ? job->orphcap * 2 : 64;
+        job->orphans =
+            realloc(job->orphans, job->orphcap * sizeof(struct saveOrphan));
+        if (job->orphans == NULL) {
+            die("realloc");
+        }
+    }
+    job->orphans[job->norphans].chars = row->chars;
+    job->orphans[job->norphans].cap = row->ccap;
+    job->norphans++;
+}
+
+void editorFreeRow(erow* row) {
+    arenaFree(row->render, row->rcap, row->rsize + 1);
+    if (editorRowShared(row)) {
+        editorRowOrphanChars(row);
+    } else if (!row->mapped) {
+        arenaFree(row->chars, row->ccap, row->ccap);
+    }
+    arenaFree(row->hl, row->hlcap, row->nspans * sizeof(hlSpan));
+    arenaFree(row->tabs, row->tabcap, row->ntabs * sizeof(struct rowTab));
+    arenaFree(row, sizeof(erow), sizeof(erow));
+}
+
+/* Rows loaded from the mapping borrow their chars until first edited, and
+ * rows in the snapshot of a running save get a copy of their own. */
+void editorRowOwnChars(erow* row) {
+    if (editorRowShared(row)) {
+        size_t cap;
+        char* chars = arenaAlloc(row->ccap, &cap);
+        ssize_t taillen = row->size - row->gap;
+        memcpy(chars, row->chars, row->gap);
+        memcpy(chars + cap - taillen, editorRowTail(row), taillen);
+        editorRowOrphanChars(row);
+        row->chars = chars;
+        row->savegen = 0;
+        return;
+    }
+    if (!row->mapped) {
+        return;
+    }
+    char* chars = editorAllocChars(row->size, &row->ccap);
+    memcpy(chars, row->chars, row->size);
+    row->chars = chars;
+    row->gap = row->size;
+    row->mapped = 0;
+}
+
+void editorDelRow(ssize_t at) {
+    if (at < 0 || at >= E.numrows) {
+        return;
+    }
+    erow* row = editorRow(at);
+    int in = E.syntax ? ropeInState(row->leaf, row->slot) : 0;
+    editorFreeRow(ropeRemove(at));
+    editorMarkStale(at);
+    erow* next = editorRow(at);
+    if (next) {
+        next->stale |= ROW_STALE_HL;
+        // the row below starts where the deleted one did
+        if (next->slot == 0) {
+            ropeSetIn(next->leaf, in);
+        }
+    }
+    E.numrows--;
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow* row, ssize_t at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    ssize_t rx = editorRowCxToRx(row, at);
+    editorRowOwnChars(row);
+    editorRowReserve(row, 1);
+    editorRowMoveGap(row, at);
+    row->chars[row->gap++] = c;
+    row->size++;
+    editorRowSplice(row, rx, 0, 1);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len) {
+    editorRowOwnChars(row);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, row->size);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->size += len;
+    editorRowSplice(row, row->rsize, 0, len);
+    E.dirty++;
+}
+
+// drop everything from char `at` to the end of the row
+void editorRowTruncate(erow* row, ssize_t at) {
+    editorRowOwnChars(row);
+    editorRowMoveGap(row, at);
+    ssize_t rx = editorRowCxToRx(row, at);
+    row->size = at;
+    editorRowSplice(row, rx, row->rsize - rx, 0);
+}
+
+void editorRowDelChar(erow* row, ssize_t at) {
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+
+    editorRowOwnChars(row);
+    editorRowMoveGap(row, at + 1);
+    ssize_t rx = editorRowCxToRx(row, at);
+    ssize_t oldw = editorRenderSpan(NULL, &row->chars[at], 1, rx) - rx;
+    row->gap--;
+    row->size--;
+    editorRowSplice(row, rx, oldw, 0);
+    E.dirty++;
+}
+
+/*+++ editor operations +++*/
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRow(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewLine() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow* row = editorRow(E.cy);
+        editorRowOwnChars(row);
+        editorRowMoveGap(row, E.cx);
+        editorInsertRow(E.cy + 1, editorRowTail(row), row->size - E.cx);
+        editorRowTruncate(row, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) {
+        return;
+    }
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+    erow* row = editorRow(E.cy);
+    if (E.cx > 0) {
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        erow* prev = editorRowPrev(row);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->gap);
+        editorRowAppendString(prev, editorRowTail(row), row->size - row->gap);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+// memory the rows take up, with what is lost to rounding and free blocks
+void editorShowInfo() {
+    struct rowArena* a = &E.arena;
+    editorSetStatusMessage(
+        "%zd lines | rows: %zuK used %zuK slack %zuK free | redraw %zdB",
+        E.numrows, a->requested >> 10, (a->allocated - a->requested) >> 10,
+        (a->reserved - a->allocated) >> 10, E.screen.written);
+}
+
+/*+++ file i/o +++*/
+
+/* Finding line ends is most of the work of opening a file, and lines are
+ * often so short that calling memchr once per line costs more than the
+ * search itself. The vector versions compare a whole block against '\n' at
+ * once and count the hits with popcount, and only look for the exact bit in
+ * the block that holds the line we are after. */
+
+/* Offset just past the `*n`-th newline in the `len` bytes at p. If there are
+ * fewer, returns -1 and takes the number seen off *n. */
+ssize_t scanNewlinesScalar(const char* p, ssize_t len, int* n) {
+    const char* q = p;
+    const char* end = p + len;
+    while (q < end) {
+        const char* nl = memchr(q, '\n', end - q);
+        if (nl == NULL) {
+            break;
+        }
+        q = nl + 1;
+        if (--*n == 0) {
+            return q - p;
+        }
+    }
+    return -1;
+}
+
+// index of the k-th lowest set bit of m, k >= 1
+int scanNthBit(unsigned int m, int k) {
+    while (--k) {
+        m &= m - 1;
+    }
+    return __builtin_ctz(m);
+}
+
+#if defined(__SSE2__)
+ssize_t scanNewlinesSSE2(const char* p, ssize_t len, int* n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    ssize_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        int c = __builtin_popcount(m);
+        if (c >= *n) {
+            i += scanNthBit(m, *n) + 1;
+            *n = 0;
+            return i;
+        }
+        *n -= c;
+    }
+    ssize_t off = scanNewlinesScalar(p + i, len - i, n);
+    return off == -1 ? -1 : i + off;
+}
+
+__attribute__((target("avx2"))) ssize_t scanNewlinesAVX2(const char* p,
+                                                         ssize_t len, int* n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    ssize_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        int c = __builtin_popcount(m);
+        if (c >= *n) {
+            i += scanNthBit(m, *n) + 1;
+            *n = 0;
+            return i;
+        }
+        *n -= c;
+    }
+    ssize_t off = scanNewlinesSSE2(p + i, len - i, n);
+    return off == -1 ? -1 : i + off;
+}
+#endif
+
+ssize_t (*scanNewlines)(const char* p, ssize_t len, int* n) =
+    scanNewlinesScalar;
+
+// pick the widest scanner the CPU runs, before any loader thread starts
+void scanNewlinesInit() {
+#if defined(__SSE2__)
+    scanNewlines = scanNewlinesSSE2;
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        scanNewlines = scanNewlinesAVX2;
+    }
+#endif
+#endif
+}
+
+/* Indexing a big mapping is split into byte ranges, each cut at a line start
+ * and indexed into its own run of leaves on a worker thread. The runs are
+ * then chained in order; a leaf at the end of a range may come out short. */
+#define LOAD_CHUNK_MIN (16 << 20)
+#define LOAD_THREADS_MAX 64
+
+struct loadChunk {
+    pthread_t thread;
+    int started;       // indexed on its own thread, to be joined
+    const char* from;  // first line of the range
+    const char* to;    // first line of the next range
+    ropeNode** leaves;
+    ssize_t nleaves;
+    ssize_t numrows;
+};
+
+void* loadChunkThread(void* arg) {
+    struct loadChunk* c = arg;
+    const char* p = c->from;
+    ssize_t cap = 0;
+    ropeNode* prev = NULL;
+    while (p < c->to) {
+        ropeNode* n = calloc(1, sizeof(ropeNode));
+        if (n == NULL) {
+            die("calloc");
+        }
+        n->leaf = 1;
+        n->map = p;
+        n->hlin = -1;
+        n->stale = ROW_STALE_HL;
+        int left = ROPE_LEAF_MAX;
+        ssize_t off = scanNewlines(p, c->to - p, &left);
+        if (off != -1) {
+            n->count = ROPE_LEAF_MAX;
+            p += off;
+        } else {
+            // the range ran out, maybe in the middle of the last line
+            n->count = ROPE_LEAF_MAX - left + (c->to[-1] != '\n');
+            p = c->to;
+        }
+        n->numrows = n->count;
+        n->prev = prev;
+        if (prev) {
+            prev->next = n;
+        }
+        prev = n;
+
+        if (c->nleaves == cap) {
+            cap = cap ? cap * 2 : 1024;
+            c->leaves = realloc(c->leaves, sizeof(ropeNode*) * cap);
+            if (c->leaves == NULL) {
+                die("realloc");
+            }
+        }
+        c->leaves[c->nleaves++] = n;
+        c->numrows += n->count;
+    }
+    return NULL;
+}
+
+/* Open a regular file by mapping it and only indexing where every
+ * ROPE_LEAF_MAX-th line starts. Rows are created as leaves get loaded, and
+ * until a row is edited its chars stay in the mapping. */
+int editorMapFile(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    E.map = map;
+    E.maplen = st.st_size;
+
+    scanNewlinesInit();
+    long nchunks = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nchunks > (long)(E.maplen / LOAD_CHUNK_MIN)) {
+        nchunks = E.maplen / LOAD_CHUNK_MIN;
+    }
+    if (nchunks > LOAD_THREADS_MAX) {
+        nchunks = LOAD_THREADS_MAX;
+    }
+    if (nchunks < 1) {
+        nchunks = 1;
+    }
+
+    struct loadChunk chunks[LOAD_THREADS_MAX];
+    const char* end = map + E.maplen;
+    const char* from = map;
+    for (long i = 0; i < nchunks; i++) {
+        const char* to = end;
+        if (i + 1 < nchunks) {
+            // move the cut to the start of the line it falls in
+            to = map + E.maplen / nchunks * (i + 1);
+            if (to < from) {
+                to = from;
+            }
+            if (to > map && to[-1] != '\n') {
+                const char* nl = memchr(to, '\n', end - to);
+                to = nl ? nl + 1 : end;
+            }
+        }
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].from = from;
+        chunks[i].to = to;
+        from = to;
+    }
+    // the first range is indexed here, and on its own if nothing else is
+    for (long i = 1; i < nchunks; i++) {
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL,
+                                           loadChunkThread, &chunks[i]) == 0;
+        if (!chunks[i].started) {
+            loadChunkThread(&chunks[i]);
+        }
+    }
+    loadChunkThread(&chunks[0]);
+
+    ssize_t nleaves = 0;
+    for (long i = 0; i < nchunks; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+        nleaves += chunks[i].nleaves;
+    }
+
+    ropeNode** leaves = malloc(sizeof(ropeNode*) * nleaves);
+    ropeNode* prev = NULL;
+    nleaves = 0;
+    for (long i = 0; i < nchunks; i++) {
+        struct loadChunk* c = &chunks[i];
+        if (c->nleaves > 0) {
+            if (prev) {
+                prev->next = c->leaves[0];
+                c->leaves[0]->prev = prev;
+            }
+            prev = c->leaves[c->nleaves - 1];
+            memcpy(&leaves[nleaves], c->leaves, sizeof(ropeNode*) * c->nleaves);
+            nleaves += c->nleaves;
+        }
+        E.numrows += c->numrows;
+        free(c->leaves);
+    }
+    E.rows = ropeBuild(leaves, nleaves);
+    free(leaves);
+    return 0;
+}
+
+/* Throw the current document away. Rows and their buffers all come from the
+ * arena, so only the tree nodes need walking. */
+void editorCloseFile() {
+    editorSaveWait();
+    editorHighlightCancel();
+    if (E.rows) {
+        ropeFreeTree(E.rows);
+        E.rows = NULL;
+    }
+    arenaReset();
+    if (E.map) {
+        munmap(E.map, E.maplen);
+        E.map = NULL;
+        E.maplen = 0;
+    }
+    E.numrows = 0;
+    E.hlstale = 0;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+}
+
+void editorOpen(char* filename) {
+    editorCloseFile();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+    if (editorMapFile(fd) == 0) {
+        close(fd);
+        E.dirty = 0;
+        return;
+    }
+
+    FILE* fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 &&
+               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            linelen--;
+        }
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+/* The writer sends the snapshot out with writev, a batch of up to IOV_MAX
+ * pieces or SAVE_BATCH_BYTES at a time, so saving never copies the whole
+ * document and progress can be reported as batches go out. */
+#define SAVE_BATCH_BYTES (1 << 20)
+
+struct saveBatch {
+    struct saveJob* job;
+    int fd;
+    int n;
+    ssize_t bytes;  // bytes in the batch
+    ssize_t lines;  // lines done once the batch is out
+    ssize_t written;
+    struct iovec iov[IOV_MAX];
+};
+
+int saveFlush(struct saveBatch* b) {
+    struct iovec* v = b->iov;
+    int n = b->n;
+    while (n > 0) {
+        ssize_t w = writev(b->fd, v, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        b->written += w;
+        // skip what got out and retry from the middle of a short write
+        while (n > 0 && (size_t)w >= v->iov_len) {
+            w -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char*)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    b->n = 0;
+    b->bytes = 0;
+    pthread_mutex_lock(&b->job->lock);
+    b->job->lines = b->lines;
+    pthread_mutex_unlock(&b->job->lock);
+    return 0;
+}
+
+int saveAdd(struct saveBatch* b, const char* p, ssize_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    // lines still in the mapping usually follow on from the previous piece
+    if (b->n > 0) {
+        struct iovec* last = &b->iov[b->n - 1];
+        if ((char*)last->iov_base + last->iov_len == p) {
+            last->iov_len += len;
+            b->bytes += len;
+            return b->bytes >= SAVE_BATCH_BYTES ? saveFlush(b) : 0;
+        }
+    }
+    if (b->n == IOV_MAX && saveFlush(b) == -1) {
+        return -1;
+    }
+    b->iov[b->n].iov_base = (char*)p;
+    b->iov[b->n].iov_len = len;
+    b->n++;
+    b->bytes += len;
+    return b->bytes >= SAVE_BATCH_BYTES ? saveFlush(b) : 0;
+}
+
+// write every line of the snapshot, returns bytes written or -1
+ssize_t saveWritePieces(struct saveJob* job, int fd) {
+    static const char nl = '\n';
+    struct saveBatch b;
+    b.job = job;
+    b.fd = fd;
+    b.n = 0;
+    b.bytes = 0;
+    b.lines = 0;
+    b.written = 0;
+    for (ssize_t i = 0; i < job->npieces; i++) {
+        struct savePiece* piece = &job->pieces[i];
+        if (piece->lines == 0) {
+            if (saveAdd(&b, piece->a, piece->alen) == -1 ||
+                saveAdd(&b, piece->b, piece->blen) == -1 ||
+                saveAdd(&b, &nl, 1) == -1) {
+                return -1;
+            }
+            b.lines++;
+            continue;
+        }
+        // untouched lines go out together with their own newline
+        const char* m = piece->a;
+        for (int j = 0; j < piece->lines; j++) {
+            ssize_t len;
+            const char* line = m;
+            m = ropeMapLine(m, &len);
+            if (m == line + len + 1 && line[len] == '\n') {
+                if (saveAdd(&b, line, len + 1) == -1) {
+                    return -1;
+                }
+            } else if (saveAdd(&b, line, len) == -1 ||
+                       saveAdd(&b, &nl, 1) == -1) {
+                return -1;
+            }
+            b.lines++;
+        }
+    }
+    if (saveFlush(&b) == -1) {
+        return -1;
+    }
+    return b.written;
+}
+
+/* Write the snapshot to a temporary file next to the target and rename it
+ * over the target once it is safely on disk, so a failed save leaves the old
+ * file as it was. The old file stays alive under the mapping. */
+void* saveThread(void* arg) {
+    struct saveJob* job = arg;
+    char* path = job->path;
+    char* slash = strrchr(path, '/');
+    int dirlen = slash ? slash - path + 1 : 0;
+    char* tmp = malloc(strlen(path) + 16);
+    sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, path + dirlen);
+
+    // keep the permissions of the file being replaced
+    struct stat st;
+    mode_t mode;
+    if (stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode = job->mode;
+    }
+
+    ssize_t len = -1;
+    int err;
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        err = errno;
+    } else {
+        int ok = fchmod(fd, mode) != -1 &&
+                 (len = saveWritePieces(job, fd)) != -1 && fsync(fd) != -1;
+        err = errno;
+        if (close(fd) == -1 && ok) {
+            ok = 0;
+            err = errno;
+        }
+        if (ok && rename(tmp, path) != -1) {
+            // make the rename itself durable
+            char* dir = dirlen ? strndup(path, dirlen) : strdup(".");
+            int dfd = open(dir, O_RDONLY);
+            if (dfd != -1) {
+                fsync(dfd);
+                close(dfd);
+            }
+            free(dir);
+            err = 0;
+        } else {
+            if (ok) {
+                err = errno;
+            }
+            unlink(tmp);
+            len = -1;
+        }
+    }
+    free(tmp);
+
+    pthread_mutex_lock(&job->lock);
+    job->len = len;
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// point the pieces of a new snapshot at the current text of every line
+void saveSnapshot(struct saveJob* job) {
+    ssize_t cap = 0;
+    job->gen++;
+    job->npieces = 0;
+    for (ropeNode* n = ropeFirstLeaf(); n; n = n->next) {
+        int need = n->u.rows ? n->count : 1;
+        if (job->npieces + need > cap) {
+            cap = cap * 2 + need;
+            job->pieces = realloc(job->pieces, cap * sizeof(struct savePiece));
+            if (job->pieces == NULL) {
+                die("realloc");
+            }
+        }
+        if (n->u.rows == NULL) {
+            struct savePiece* piece = &job->pieces[job->npieces++];
+            piece->a = n->map;
+            piece->lines = n->count;
+            continue;
+        }
+        for (int j = 0; j < n->count; j++) {
+            erow* row = n->u.rows[j];
+            struct savePiece* piece = &job->pieces[job->npieces++];
+            piece->a = row->chars;
+            piece->alen = row->gap;
+            piece->b = editorRowTail(row);
+            piece->blen = row->size - row->gap;
+            piece->lines = 0;
+            row->savegen = job->gen;
+        }
+    }
+    job->numrows = E.numrows;
+    job->dirty = E.dirty;
+}
+
+void editorSave() {
+    if (E.save.running) {
+        editorSetStatusMessage("A save is already running");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    struct saveJob* job = &E.save;
+    // replace what a symlink points at rather than the link itself
+    job->path = realpath(E.filename, NULL);
+    if (job->path == NULL) {
+        job->path = strdup(E.filename);
+    }
+    // the umask is only read by setting it, so not on the writer thread
+    mode_t mask = umask(0);
+    umask(mask);
+    job->mode = 0644 & ~mask;
+    saveSnapshot(job);
+    job->done = 0;
+    job->lines = 0;
+    job->shown = 0;
+    if ((errno = pthread_create(&job->thread, NULL, saveThread, job)) != 0) {
+        free(job->path);
+        editorSetStatusMessage("Can't save! %s", strerror(errno));
+        return;
+    }
+    job->running = 1;
+    editorSetStatusMessage("Saving...");
+}
+
+// wait for the running save, if any, and report how it went
+void editorSaveWait() {
+    struct saveJob* job = &E.save;
+    if (!job->running) {
+        return;
+    }
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+    for (ssize_t i = 0; i < job->norphans; i++) {
+        arenaFree(job->orphans[i].chars, job->orphans[i].cap,
+                  job->orphans[i].cap);
+    }
+    job->norphans = 0;
+    free(job->path);
+    if (job->len == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s",
+                               strerror(job->err));
+        return;
+    }
+    E.dirty -= job->dirty;  // edits made while saving are still unsaved
+    editorSetStatusMessage("%zd bytes written to disk", job->len);
+}
+
+// check on the running save, returns 1 if the status bar changed
+int editorSavePoll() {
+    struct saveJob* job = &E.save;
+    if (!job->running || E.prompting) {
+        return 0;
+    }
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    ssize_t lines = job->lines;
+    pthread_mutex_unlock(&job->lock);
+    if (done) {
+        editorSaveWait();
+        return 1;
+    }
+    int percent = job->numrows ? lines * 100 / job->numrows : 0;
+    if (percent == job->shown) {
+        return 0;
+    }
+    job->shown = percent;
+    editorSetStatusMessage("Saving... %d%%", percent);
+    return 1;
+}
+
+/*+++ regex +++*/
+
+/* Regular expressions for the search prompt: . [] [^] \d \w \s \D \W \S * +
+ * ? {m,n} | () ^ $, \t for a tab, and \ before anything else takes it as it
+ * is. Like a plain query, a pattern with no capitals matches either case.
+ * It is parsed into a tree, which is compiled into an NFA twice, forwards
+ * and backwards. The NFAs run as DFAs that are built while they run: a DFA
+ * state is a set of NFA states, and the state a symbol leads to is worked
+ * out the first time it is taken, then looked up. A DFA that grows past
+ * RE_DFA_MAX states drops them all and starts again, so a pattern that
+ * blows up only slows down to stepping the NFA. Either way a row is read
+ * once per automaton run over it. */
+
+enum reNodeType {
+    RE_N_EMPTY,
+    RE_N_SET,
+    RE_N_MARK,
+    RE_N_CAT,
+    RE_N_ALT,
+    RE_N_REPEAT
+};
+
+struct reNode {
+    int type;
+    int a, b;      // children
+    int min, max;  // RE_N_REPEAT, max -1 for no limit
+    int sym;       // RE_N_MARK
+    unsigned char set[32];  // RE_N_SET
+};
+
+struct reParser {
+    const char* p;
+    struct reNode* nodes;
+    int n;
+    int cap;
+    int icase;
+    const char* err;  // what is wrong with the pattern, NULL while nothing
+};
+
+#define RE_DFA_TABLE (2 * RE_DFA_MAX)
+
+void reSetAdd(unsigned char* set, int c) { set[c >> 3] |= 1 << (c & 7); }
+
+int reSetHas(const unsigned char* set, int c) {
+    return set[c >> 3] >> (c & 7) & 1;
+}
+
+// let every letter in set match in either case
+void reSetFold(unsigned char* set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (reSetHas(set, c) || reSetHas(set, c - 'a' + 'A')) {
+            reSetAdd(set, c);
+            reSetAdd(set, c - 'a' + 'A');
+        }
+    }
+}
+
+// add the bytes of \d \w \s, or those not in them for \D \W \S
+int reSetClass(unsigned char* set, char c) {
+    unsigned char class[32] = {0};
+    int neg = c >= 'A' && c <= 'Z';
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            for (int i = '0'; i <= '9'; i++) {
+                reSetAdd(class, i);
+            }
+            break;
+        case 'w':
+            for (int i = 0; i < 256; i++) {
+                if (isalnum(i) || i == '_') {
+                    reSetAdd(class, i);
+                }
+            }
+            break;
+        case 's':
+            for (const char* s = " \t\n\r\f\v"; *s; s++) {
+                reSetAdd(class, *s);
+            }
+            break;
+        default:
+            return 0;
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] |= neg ? ~class[i] : class[i];
+    }
+    return 1;
+}
+
+// the byte an escape other than a class stands for
+int reEscape(char c) { return c == 't' ? '\t' : (unsigned char)c; }
+
+int reNewNode(struct reParser* ps, int type, int a, int b) {
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 64;
+        ps->nodes = realloc(ps->nodes, ps->cap * sizeof(struct reNode));
+        if (ps->nodes == NULL) {
+            die("realloc");
+        }
+    }
+    struct reNode* nd = &ps->nodes[ps->n];
+    memset(nd, 0, sizeof(*nd));
+    nd->type = type;
+    nd->a = a;
+    nd->b = b;
+    return ps->n++;
+}
+
+int reParseAlt(struct reParser* ps);
+
+// the inside of [], after the [
+int reParseClass(struct reParser* ps) {
+    unsigned char set[32] = {0};
+    int neg = *ps->p == '^';
+    ps->p += neg;
+    // a ] right at the start is taken as itself
+    for (int first = 1; *ps->p && (*ps->p != ']' || first); first = 0) {
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && *ps->p) {
+            if (reSetClass(set, *ps->p)) {
+                ps->p++;
+                continue;
+            }
+            lo = reEscape(*ps->p++);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) {
+                hi = reEscape(*ps->p++);
+            }
+            if (hi < lo) {
+                ps->err = "bad range";
+                return -1;
+            }
+        }
+        for (int c = lo; c <= hi; c++) {
+            reSetAdd(set, c);
+        }
+    }
+    if (*ps->p != ']') {
+        ps->err = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    if (ps->icase) {
+        reSetFold(set);
+    }
+    for (int i = 0; neg && i < 32; i++) {
+        set[i] = ~set[i];
+    }
+    int n = reNewNode(ps, RE_N_SET, -1, -1);
+    memcpy(ps->nodes[n].set, set, sizeof(set));
+    return n;
+}
+
+int reParseAtom(struct reParser* ps) {
+    char c = *ps->p++;
+    int n;
+    switch (c) {
+        case '(':
+            n = reParseAlt(ps);
+            if (ps->err) {
+                return -1;
+            }
+            if (*ps->p != ')') {
+                ps->err = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return n;
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            ps->err = "nothing to repeat";
+            return -1;
+        case '[':
+            return reParseClass(ps);
+        case '^':
+        case '$':
+            n = reNewNode(ps, RE_N_MARK, -1, -1);
+            ps->nodes[n].sym = c == '^' ? RE_BOL : RE_EOL;
+            return n;
+    }
+    n = reNewNode(ps, RE_N_SET, -1, -1);
+    unsigned char* set = ps->nodes[n].set;
+    if (c == '.') {
+        memset(set, 0xff, 32);
+    } else if (c != '\\') {
+        reSetAdd(set, (unsigned char)c);
+    } else if (*ps->p == '\0') {
+        ps->err = "trailing \\";
+        return -1;
+    } else {
+        c = *ps->p++;
+        if (!reSetClass(set, c)) {
+            reSetAdd(set, reEscape(c));
+        }
+    }
+    if (ps->icase) {
+        reSetFold(set);
+    }
+    return n;
+}
+
+// {m}, {m,} or {m,n}
+int reParseCount(struct reParser* ps, int* min, int* max) {
+    char* end = (char*)ps->p + 1;
+    long m = -1;
+    long n = -1;
+    if (isdigit((unsigned char)*end)) {
+        m = n = strtol(end, &end, 10);
+    }
+    if (*end == ',') {
+        end++;
+        n = isdigit((unsigned char)*end) ? strtol(end, &end, 10) : -1;
+    }
+    if (*end != '}' || m < 0 || m > RE_REPEAT_MAX || n > RE_REPEAT_MAX ||
+        (n >= 0 && n < m)) {
+        ps->err = "bad {m,n}";
+        return 0;
+    }
+    ps->p = end + 1;
+    *min = m;
+    *max = n;
+    return 1;
+}
+
+int reParseRepeat(struct reParser* ps) {
+    int n = reParseAtom(ps);
+    while (!ps->err) {
+        int min = 0;
+        int max = -1;
+        if (*ps->p == '{') {
+            if (!reParseCount(ps, &min, &max)) {
+                return -1;
+            }
+        } else if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+            min = *ps->p == '+';
+            max = *ps->p == '?' ? 1 : -1;
+            ps->p++;
+        } else {
+            break;
+        }
+        n = reNewNode(ps, RE_N_REPEAT, n, -1);
+        ps->nodes[n].min = min;
+        ps->nodes[n].max = max;
+    }
+    return ps->err ? -1 : n;
+}
+
+int reParseCat(struct reParser* ps) {
+    int n = reNewNode(ps, RE_N_EMPTY, -1, -1);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int b = reParseRepeat(ps);
+        if (ps->err) {
+            return -1;
+        }
+        n = reNewNode(ps, RE_N_CAT, n, b);
+    }
+    return n;
+}
+
+int reParseAlt(struct reParser* ps) {
+    int n = reParseCat(ps);
+    while (!ps->err && *ps->p == '|') {
+        ps->p++;
+        int b = reParseCat(ps);
+        if (ps->err) {
+            return -1;
+        }
+        n = reNewNode(ps, RE_N_ALT, n, b);
+    }
+    return ps->err ? -1 : n;
+}
+
+// a new NFA state, -1 once the pattern is too big
+int reAddState(struct regex* re, int op, int out, int out1) {
+    if (re->nst == RE_NFA_MAX) {
+        return -1;
+    }
+    if (re->nst == re->cap) {
+        re->cap = re->cap ? re->cap * 2 : 64;
+        re->st = realloc(re->st, re->cap * sizeof(struct reState));
+        if (re->st == NULL) {
+            die("realloc");
+        }
+    }
+    struct reState* s = &re->st[re->nst];
+    memset(s, 0, sizeof(*s));
+    s->op = op;
+    s->out = out;
+    s->out1 = out1;
+    return re->nst++;
+}
+
+/* Compile the tree at node n into states that go on to `next` once they
+ * matched, backwards with `rev`. Returns the state to start from, -1 if the
+ * pattern got too big. A counted repeat gets a copy of its body per count. */
+int reCompileNode(struct regex* re, const struct reParser* ps, int n,
+                  int next, int rev) {
+    const struct reNode* nd = &ps->nodes[n];
+    int s;
+    if (next < 0) {
+        return -1;
+    }
+    switch (nd->type) {
+        case RE_N_SET:
+        case RE_N_MARK:
+            s = reAddState(re, nd->type == RE_N_SET ? RE_SET : RE_MARK, next,
+                           -1);
+            if (s >= 0) {
+                memcpy(re->st[s].set, nd->set, sizeof(nd->set));
+                re->st[s].sym = nd->sym;
+            }
+            return s;
+        case RE_N_CAT:
+            // backwards the second half is met first
+            s = reCompileNode(re, ps, rev ? nd->a : nd->b, next, rev);
+            return reCompileNode(re, ps, rev ? nd->b : nd->a, s, rev);
+        case RE_N_ALT:
+            s = reCompileNode(re, ps, nd->b, next, rev);
+            n = reCompileNode(re, ps, nd->a, next, rev);
+            return (s < 0 || n < 0) ? -1 : reAddState(re, RE_SPLIT, n, s);
+        case RE_N_REPEAT:
+            s = next;
+            if (nd->max < 0) {
+                // loop back through a split that may leave
+                s = reAddState(re, RE_SPLIT, -1, next);
+                n = reCompileNode(re, ps, nd->a, s, rev);
+                if (n < 0) {
+                    return -1;
+                }
+                re->st[s].out = n;
+            }
+            // the optional copies nest: (a(a)?)?
+            for (int i = nd->min; i < nd->max; i++) {
+                n = reCompileNode(re, ps, nd->a, s, rev);
+                s = n < 0 ? -1 : reAddState(re, RE_SPLIT, n, next);
+            }
+            for (int i = 0; i < nd->min; i++) {
+                s = reCompileNode(re, ps, nd->a, s, rev);
+            }
+            return s;
+    }
+    return next;  // RE_N_EMPTY
+}
+
+// the start state of an NFA that runs `s` anywhere in the text
+int reCompileAnywhere(struct regex* re, int s) {
+    int split = reAddState(re, RE_SPLIT, s, -1);
+    int any = reAddState(re, RE_ANY, split, -1);
+    if (s < 0 || any < 0) {
+        return -1;
+    }
+    re->st[split].out1 = any;
+    return split;
+}
+
+// can state s get to a match without taking a byte
+int reNullable(const struct regex* re, int s, char* seen) {
+    if (seen[s]) {
+        return 0;
+    }
+    seen[s] = 1;
+    switch (re->st[s].op) {
+        case RE_MATCH:
+            return 1;
+        case RE_MARK:
+            return reNullable(re, re->st[s].out, seen);
+        case RE_SPLIT:
+            return reNullable(re, re->st[s].out, seen) ||
+                   reNullable(re, re->st[s].out1, seen);
+    }
+    return 0;
+}
+
+void reFree(struct regex* re) {
+    if (re) {
+        free(re->st);
+        free(re);
+    }
+}
+
+// compile `pattern`, NULL with *err set if it is not a valid one
+struct regex* reCompile(const char* pattern, const char** err) {
+    struct reParser ps = {pattern, NULL, 0, 0, 0, NULL};
+    for (const char* p = pattern; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p >= 'A' && *p <= 'Z') {
+            ps.icase = 0;
+            break;
+        } else if (*p >= 'a' && *p <= 'z') {
+            ps.icase = 1;
+        }
+    }
+    int root = reParseAlt(&ps);
+    if (!ps.err && *ps.p) {
+        ps.err = "unmatched )";
+    }
+    struct regex* re = NULL;
+    if (!ps.err) {
+        re = calloc(1, sizeof(*re));
+        if (re == NULL) {
+            die("calloc");
+        }
+        int match = reAddState(re, RE_MATCH, -1, -1);
+        re->fwd = reCompileNode(re, &ps, root, match, 0);
+        int bol = reAddState(re, RE_MARK, re->fwd, -1);
+        re->fwd0 = reAddState(re, RE_SPLIT, bol, re->fwd);
+        re->ufwd = reCompileAnywhere(re, re->fwd);
+        int rev = reCompileNode(re, &ps, root, match, 1);
+        re->urev = reCompileAnywhere(re, rev);
+        if (re->fwd < 0 || bol < 0 || re->fwd0 < 0 || re->ufwd < 0 ||
+            re->urev < 0) {
+            ps.err = "pattern too big";
+            reFree(re);
+            re = NULL;
+        } else {
+            re->st[bol].sym = RE_BOL;
+            char* seen = calloc(re->nst, 1);
+            if (seen == NULL) {
+                die("calloc");
+            }
+            re->nullable = reNullable(re, re->fwd, seen);
+            free(seen);
+        }
+    }
+    free(ps.nodes);
+    *err = ps.err;
+    return re;
+}
+
+void reDfaInit(struct reDfa* d, const struct regex* re, int start) {
+    memset(d, 0, sizeof(*d));
+    d->re = re;
+    d->start = start;
+    d->init = -1;
+}
+
+// drop every state, keeping the memory
+void reDfaReset(struct reDfa* d) {
+    for (int i = 0; i < d->nstates; i++) {
+        free(d->states[i].set);
+    }
+    d->nstates = 0;
+    d->init = -1;
+    d->resets++;
+    for (int i = 0; d->table && i < RE_DFA_TABLE; i++) {
+        d->table[i] = -1;
+    }
+}
+
+void reDfaFree(struct reDfa* d) {
+    reDfaReset(d);
+    free(d->states);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+    d->states = NULL;
+    d->table = d->mark = d->stack = d->buf = NULL;
+    d->cap = 0;
+}
+
+// start building a new set in d->buf
+void reDfaBegin(struct reDfa* d) {
+    if (++d->gen == INT_MAX) {
+        memset(d->mark, 0, d->re->nst * sizeof(int));
+        d->gen = 1;
+    }
+    d->nbuf = 0;
+}
+
+/* Add to d->buf the states s gets to without taking a symbol. Right after
+ * the start or the end of the row, `sym`, more ^ or $ take nothing. */
+void reDfaClosure(struct reDfa* d, int s, int sym) {
+    const struct reState* st = d->re->st;
+    int top = 0;
+    if (d->mark[s] != d->gen) {
+        d->mark[s] = d->gen;
+        d->stack[top++] = s;
+    }
+    while (top) {
+        s = d->stack[--top];
+        if (st[s].op == RE_MARK && st[s].sym == sym) {
+            if (d->mark[st[s].out] != d->gen) {
+                d->mark[st[s].out] = d->gen;
+                d->stack[top++] = st[s].out;
+            }
+            continue;
+        }
+        if (st[s].op != RE_SPLIT) {
+            d->buf[d->nbuf++] = s;
+            continue;
+        }
+        if (d->mark[st[s].out] != d->gen) {
+            d->mark[st[s].out] = d->gen;
+            d->stack[top++] = st[s].out;
+        }
+        if (d->mark[st[s].out1] != d->gen) {
+            d->mark[st[s].out1] = d->gen;
+            d->stack[top++] = st[s].out1;
+        }
+    }
+}
+
+int reCompareInt(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// the DFA state of the set in d->buf, added if it is new
+int reDfaAdd(struct reDfa* d) {
+    qsort(d->buf, d->nbuf, sizeof(int), reCompareInt);
+    unsigned h = 2166136261u;
+    for (int i = 0; i < d->nbuf; i++) {
+        h = (h ^ d->buf[i]) * 16777619u;
+    }
+    h &= RE_DFA_TABLE - 1;
+    for (int at; (at = d->table[h]) >= 0; h = (h + 1) & (RE_DFA_TABLE - 1)) {
+        struct reDState* ds = &d->states[at];
+        if (ds->nset == d->nbuf &&
+            memcmp(ds->set, d->buf, d->nbuf * sizeof(int)) == 0) {
+            return at;
+        }
+    }
+    if (d->nstates == RE_DFA_MAX) {
+        reDfaReset(d);
+        return reDfaAdd(d);
+    }
+    if (d->nstates == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->states = realloc(d->states, d->cap * sizeof(struct reDState));
+        if (d->states == NULL) {
+            die("realloc");
+        }
+    }
+    struct reDState* ds = &d->states[d->nstates];
+    ds->set = malloc((d->nbuf ? d->nbuf : 1) * sizeof(int));
+    if (ds->set == NULL) {
+        die("malloc");
+    }
+    memcpy(ds->set, d->buf, d->nbuf * sizeof(int));
+    ds->nset = d->nbuf;
+    ds->match = 0;
+    for (int i = 0; i < d->nbuf; i++) {
+        ds->match |= d->re->st[d->buf[i]].op == RE_MATCH;
+    }
+    for (int i = 0; i < RE_SYMBOLS; i++) {
+        ds->next[i] = -1;
+    }
+    d->table[h] = d->nstates;
+    return d->nstates++;
+}
+
+int reDfaStart(struct reDfa* d) {
+    if (d->init < 0) {
+        if (d->table == NULL) {
+            d->table = malloc(RE_DFA_TABLE * sizeof(int));
+            d->mark = calloc(d->re->nst, sizeof(int));
+            d->stack = malloc(d->re->nst * sizeof(int));
+            d->buf = malloc(d->re->nst * sizeof(int));
+            if (!d->table || !d->mark || !d->stack || !d->buf) {
+                die("malloc");
+            }
+            for (int i = 0; i < RE_DFA_TABLE; i++) {
+                d->table[i] = -1;
+            }
+        }
+        reDfaBegin(d);
+        reDfaClosure(d, d->start, -1);
+        int init = reDfaAdd(d);
+        d->init = init << 1 | d->states[init].match;
+    }
+    return d->init;
+}
+
+// the state after taking `sym` in state `cur`
+int reDfaStep(struct reDfa* d, int cur, int sym) {
+    int next = d->states[cur >> 1].next[sym];
+    if (next >= 0) {
+        return next;
+    }
+    const struct reState* st = d->re->st;
+    const struct reDState* ds = &d->states[cur >> 1];
+    reDfaBegin(d);
+    for (int i = 0; i < ds->nset; i++) {
+        const struct reState* s = &st[ds->set[i]];
+        if (s->op == RE_ANY ||
+            (s->op == RE_SET && sym < 256 && reSetHas(s->set, sym)) ||
+            (s->op == RE_MARK && s->sym == sym)) {
+            reDfaClosure(d, s->out, sym);
+        }
+    }
+    unsigned resets = d->resets;
+    next = reDfaAdd(d);
+    next = next << 1 | d->states[next].match;
+    if (d->resets == resets) {
+        d->states[cur >> 1].next[sym] = next;
+    }
+    return next;
+}
+
+/*+++ find +++*/
+
+/* Text is searched a block at a time for where the first and the last byte
+ * of the query both are, and only there is the whole query compared. Lines
+ * are searched by length, so unlike with strstr a NUL does not end them. A
+ * query in lower case matches either case: the text is folded with OR 0x20
+ * on the way, which also turns a few non letters into others, costing a
+ * compare now and then but never a match. A query with capitals is taken as
+ * typed. */
+
+unsigned char findLower(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// prepare `query` for findIn
+void findNeedleInit(struct findNeedle* nd, const char* query) {
+    nd->s = query;
+    nd->len = strlen(query);
+    nd->icase = 0;
+    for (ssize_t i = 0; i < nd->len; i++) {
+        if (query[i] >= 'A' && query[i] <= 'Z') {
+            nd->icase = 0;
+            break;
+        }
+        if (query[i] >= 'a' && query[i] <= 'z') {
+            nd->icase = 1;
+        }
+    }
+    nd->fold = nd->icase ? 0x20 : 0;
+    if (nd->len) {
+        nd->first = query[0] | nd->fold;
+        nd->last = query[nd->len - 1] | nd->fold;
+    }
+    nd->re = NULL;
+}
+
+// prepare `query` as a regex, returns why it does not compile or NULL
+const char* findNeedleRegex(struct findNeedle* nd, const char* query) {
+    const char* err;
+    memset(nd, 0, sizeof(*nd));
+    nd->s = query;
+    nd->len = strlen(query);
+    nd->re = reCompile(query, &err);
+    return err;
 }
 
-/*+++ row operations +++*/
-int editorRowCxToRx(erow* row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+// does the text at p start with the query
+int findVerify(const struct findNeedle* nd, const char* p) {
+    if (!nd->icase) {
+        return memcmp(p, nd->s, nd->len) == 0;
+    }
+    for (ssize_t j = 0; j < nd->len; j++) {
+        if (findLower(p[j]) != (unsigned char)nd->s[j]) {
+            return 0;
         }
-        rx++;
     }
-    return rx;
+    return 1;
 }
 
-int editorRowRxToCx(erow* row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        }
-        cur_rx++;
-        if (cur_rx > rx) {
-            return cx;
+// offset of the first match in the `len` bytes at p, -1 if there is none
+ssize_t findInScalar(const struct findNeedle* nd, const char* p, ssize_t len) {
+    ssize_t last = nd->len - 1;
+    for (ssize_t i = 0; i + last < len; i++) {
+        if ((unsigned char)(p[i] | nd->fold) == nd->first &&
+            (unsigned char)(p[i + last] | nd->fold) == nd->last &&
+            findVerify(nd, p + i)) {
+            return i;
         }
     }
-    return cx;
+    return -1;
 }
 
-void editorUpdateRow(erow* row) {
-    int tabs = 0;
-    int j;
-
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
+#if defined(__SSE2__)
+ssize_t findInSSE2(const struct findNeedle* nd, const char* p, ssize_t len) {
+    const __m128i fold = _mm_set1_epi8(nd->fold);
+    const __m128i first = _mm_set1_epi8(nd->first);
+    const __m128i lastc = _mm_set1_epi8(nd->last);
+    ssize_t last = nd->len - 1;
+    ssize_t end = len - last - 16;  // where the last whole block starts
+    if (end < 0) {
+        return findInScalar(nd, p, len);
     }
-
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
+    for (ssize_t i = 0; i < end + 16; i += 16) {
+        // the rest is one block that ends at the end, minus what was seen
+        ssize_t at = i <= end ? i : end;
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + at));
+        __m128i z = _mm_loadu_si128((const __m128i*)(p + at + last));
+        __m128i hit = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(a, fold), first),
+            _mm_cmpeq_epi8(_mm_or_si128(z, fold), lastc));
+        unsigned int m = _mm_movemask_epi8(hit) & (~0u << (i - at));
+        while (m) {
+            int b = __builtin_ctz(m);
+            if (findVerify(nd, p + at + b)) {
+                return at + b;
             }
-        } else {
-            row->render[idx++] = row->chars[j];
+            m &= m - 1;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    return -1;
 }
-void editorInsertRow(int at, char* s, size_t len) {
-    if (at < 0 || at > E.numrows) {
-        return;
-    }
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-    E.row[at].idx = at;
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-
-    E.numrows++;
-    E.dirty++;
+__attribute__((target("avx2"))) ssize_t findInAVX2(const struct findNeedle* nd,
+                                                   const char* p, ssize_t len) {
+    const __m256i fold = _mm256_set1_epi8(nd->fold);
+    const __m256i first = _mm256_set1_epi8(nd->first);
+    const __m256i lastc = _mm256_set1_epi8(nd->last);
+    ssize_t last = nd->len - 1;
+    ssize_t end = len - last - 32;
+    if (end < 0) {
+        return findInSSE2(nd, p, len);
+    }
+    for (ssize_t i = 0; i < end + 32; i += 32) {
+        ssize_t at = i <= end ? i : end;
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + at));
+        __m256i z = _mm256_loadu_si256((const __m256i*)(p + at + last));
+        __m256i hit = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(a, fold), first),
+            _mm256_cmpeq_epi8(_mm256_or_si256(z, fold), lastc));
+        unsigned int m = _mm256_movemask_epi8(hit) & (~0u << (i - at));
+        while (m) {
+            int b = __builtin_ctz(m);
+            if (findVerify(nd, p + at + b)) {
+                return at + b;
+            }
+            m &= m - 1;
+        }
+    }
+    return -1;
 }
+#endif
 
-void editorFreeRow(erow* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+ssize_t (*findIn)(const struct findNeedle* nd, const char* p, ssize_t len) =
+    findInScalar;
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) {
-        return;
+void findInInit() {
+#if defined(__SSE2__)
+    findIn = findInSSE2;
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        findIn = findInAVX2;
     }
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+#endif
+#endif
 }
 
-void editorRowInsertChar(erow* row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+void findMatcherInit(struct findMatcher* m, const struct findNeedle* nd) {
+    memset(m, 0, sizeof(*m));
+    m->nd = nd;
+    if (nd->re) {
+        reDfaInit(&m->fwd, nd->re, nd->re->fwd);
+        reDfaInit(&m->fwd0, nd->re, nd->re->fwd0);
+        reDfaInit(&m->ufwd, nd->re, nd->re->ufwd);
+        reDfaInit(&m->urev, nd->re, nd->re->urev);
     }
-    // making room for null byte?(I don't get this? isnt the null byte already
-    // there??????)
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memmove(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void findMatcherFree(struct findMatcher* m) {
+    if (m->nd && m->nd->re) {
+        reDfaFree(&m->fwd);
+        reDfaFree(&m->fwd0);
+        reDfaFree(&m->ufwd);
+        reDfaFree(&m->urev);
+    }
+    free(m->starts);
+    memset(m, 0, sizeof(*m));
 }
 
-void editorRowDelChar(erow* row, int at) {
-    if (at < 0 || at >= row->size) {
-        return;
+// does the regex match anywhere in the `len` bytes at p
+int reAny(struct findMatcher* m, const char* p, ssize_t len) {
+    struct reDfa* d = &m->ufwd;
+    int s = reDfaStep(d, reDfaStart(d), RE_BOL);
+    for (ssize_t i = 0; i < len && !(s & 1); i++) {
+        int next = d->states[s >> 1].next[(unsigned char)p[i]];
+        s = next >= 0 ? next : reDfaStep(d, s, (unsigned char)p[i]);
     }
-
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->chars = realloc(row->chars, row->size);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    return (s & 1) || (reDfaStep(d, s, RE_EOL) & 1);
 }
 
-/*+++ editor operations +++*/
-
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+/* Mark in m->starts where a match starts from `from` on: where the pattern
+ * run backwards from the end of the row is in a match. */
+void reStarts(struct findMatcher* m, const char* p, ssize_t len,
+              ssize_t from) {
+    if (len > m->startscap) {
+        m->startscap = len * 2;
+        m->starts = realloc(m->starts, m->startscap);
+        if (m->starts == NULL) {
+            die("realloc");
+        }
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    struct reDfa* d = &m->urev;
+    int s = reDfaStep(d, reDfaStart(d), RE_EOL);
+    for (ssize_t i = len - 1; i >= from; i--) {
+        int next = d->states[s >> 1].next[(unsigned char)p[i]];
+        s = next >= 0 ? next : reDfaStep(d, s, (unsigned char)p[i]);
+        m->starts[i] = s & 1;
+    }
+    if (from == 0 && (reDfaStep(d, s, RE_BOL) & 1)) {
+        m->starts[0] = 1;
+    }
+    m->sp = p;
+    m->slen = len;
+    m->sfrom = from;
 }
 
-void editorInsertNewLine() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow* row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// end of the longest match starting at `at`, -1 if none does
+ssize_t reLongest(struct findMatcher* m, const char* p, ssize_t len,
+                  ssize_t at) {
+    struct reDfa* d = at == 0 ? &m->fwd0 : &m->fwd;
+    int s = reDfaStart(d);
+    if (at == 0) {
+        s = reDfaStep(d, s, RE_BOL);
     }
-    E.cy++;
-    E.cx = 0;
+    ssize_t end = (s & 1) ? at : -1;
+    ssize_t i;
+    for (i = at; i < len && d->states[s >> 1].nset; i++) {
+        s = reDfaStep(d, s, (unsigned char)p[i]);
+        if (s & 1) {
+            end = i + 1;
+        }
+    }
+    if (i == len && (reDfaStep(d, s, RE_EOL) & 1)) {
+        end = len;
+    }
+    return end;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) {
-        return;
+/* Offset of the first match at or after `from`, -1 if there is none, and
+ * where it ends in *end. A regex match is the longest one from the leftmost
+ * start; matches that are empty are passed over. The starts are found once
+ * per row, so the matches of a row go from 0 up and then on to the next. */
+ssize_t findNext(struct findMatcher* m, const char* p, ssize_t len,
+                 ssize_t from, ssize_t* end) {
+    const struct findNeedle* nd = m->nd;
+    if (from >= len) {
+        return -1;
     }
-    if (E.cx == 0 && E.cy == 0) {
-        return;
+    if (nd->re == NULL) {
+        ssize_t off = findIn(nd, p + from, len - from);
+        if (off < 0) {
+            return -1;
+        }
+        *end = from + off + nd->len;
+        return from + off;
     }
-    erow* row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+    if (from == 0 || p != m->sp || len != m->slen || from < m->sfrom) {
+        if (from == 0 && !nd->re->nullable && !reAny(m, p, len)) {
+            m->sp = NULL;
+            return -1;
+        }
+        reStarts(m, p, len, from);
+    }
+    for (ssize_t at = from; at < len; at++) {
+        const char* s = memchr(m->starts + at, 1, len - at);
+        if (s == NULL) {
+            break;
+        }
+        at = s - m->starts;
+        ssize_t e = reLongest(m, p, len, at);
+        if (e > at) {
+            *end = e;
+            return at;
+        }
     }
+    return -1;
 }
-/*+++ file i/o +++*/
 
-char* editorRowsToString(int* buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
-    }
-    *buflen = totlen;
+/* Where to look for the match after the one from `at` to `end`. Matches of
+ * plain text may overlap, those of a regex follow each other. */
+ssize_t findAfter(const struct findMatcher* m, ssize_t at, ssize_t end) {
+    return m->nd->re ? end : at + 1;
+}
 
-    char* buf = malloc(totlen);
-    char* p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+// index in E.find.lines of the first line at or after `line`
+ssize_t findLineIndex(ssize_t line) {
+    struct findState* f = &E.find;
+    ssize_t lo = 0;
+    ssize_t hi = f->nlines;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (f->lines[mid] < line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
+}
 
-    return buf;
+// index in E.find.lines of the line that holds match `m`
+ssize_t findMatchIndex(ssize_t m) {
+    struct findState* f = &E.find;
+    ssize_t lo = 0;
+    ssize_t hi = f->nlines - 1;
+    while (lo < hi) {
+        ssize_t mid = hi - (hi - lo) / 2;
+        if (f->before[mid] <= m) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
 }
 
-void editorOpen(char* filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+/* One range of lines searched on its own thread. Rows that are loaded but
+ * not rendered, and lines still in the mapping, are rendered into a scratch
+ * of the range: nothing shared is written while the threads run. */
+struct findChunk {
+    pthread_t thread;
+    int started;
+    int main;  // searched on the main thread, which watches for keys
+    struct findMatcher m;
+    ropeNode* leaf;       // leaf holding the first line of the range
+    ssize_t leafline;     // line that leaf starts at
+    ssize_t from, to;     // the range, as lines
+    const ssize_t* cand;  // when refining, the lines in it found last time
+    ssize_t ncand;
+    ssize_t* lines;   // lines found
+    ssize_t* counts;  // matches in each of them
+    ssize_t nlines;
+    ssize_t cap;
+    char* scratch;
+    size_t scratchcap;
+    int polls;
+};
 
-    editorSelectSyntaxHighlight();
+// render the chars before and after a gap into the scratch of the range
+char* findChunkRender(struct findChunk* c, const char* a, ssize_t alen,
+                      const char* b, ssize_t blen, ssize_t* rsize) {
+    ssize_t rx = editorRenderSpan(NULL, a, alen, 0);
+    *rsize = editorRenderSpan(NULL, b, blen, rx);
+    if ((size_t)*rsize > c->scratchcap) {
+        c->scratchcap = *rsize * 2;
+        c->scratch = realloc(c->scratch, c->scratchcap);
+        if (c->scratch == NULL) {
+            die("realloc");
+        }
+    }
+    editorRenderSpan(c->scratch, a, alen, 0);
+    editorRenderSpan(c->scratch, b, blen, rx);
+    return c->scratch;
+}
 
-    FILE* fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+/* The main thread gives up when a key is waiting, as the query is about to
+ * change, and the others give up with it. */
+int findChunkCancelled(struct findChunk* c) {
+    struct findState* f = &E.find;
+    int key = 0;
+    if (c->main && ++c->polls % FIND_POLL_LEAVES == 0) {
+        struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+        key = poll(&in, 1, 0) > 0;
+    }
+    pthread_mutex_lock(&f->lock);
+    f->cancel |= key;
+    int cancel = f->cancel;
+    pthread_mutex_unlock(&f->lock);
+    return cancel;
+}
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 &&
-               (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+void* findChunkThread(void* arg) {
+    struct findChunk* c = arg;
+    ssize_t k = 0;  // next of the lines found last time, when refining
+    ssize_t line = c->leafline;
+    for (ropeNode* leaf = c->leaf; leaf && line < c->to;
+         line += leaf->count, leaf = leaf->next) {
+        if (findChunkCancelled(c)) {
+            break;
+        }
+        if (c->cand && (k == c->ncand || c->cand[k] >= line + leaf->count)) {
+            continue;
+        }
+        const char* p = leaf->map;
+        for (int j = 0; j < leaf->count; j++) {
+            ssize_t len = 0;
+            const char* next = leaf->u.rows ? NULL : ropeMapLine(p, &len);
+            ssize_t at = line + j;
+            if (at < c->from || at >= c->to ||
+                (c->cand && (k == c->ncand || c->cand[k] != at))) {
+                p = next;
+                continue;
+            }
+            k++;
+            char* render;
+            ssize_t rsize;
+            if (leaf->u.rows == NULL) {
+                render = findChunkRender(c, p, len, NULL, 0, &rsize);
+            } else if (leaf->u.rows[j]->stale & ROW_STALE_RENDER) {
+                erow* row = leaf->u.rows[j];
+                render = findChunkRender(c, row->chars, row->gap,
+                                         editorRowTail(row),
+                                         row->size - row->gap, &rsize);
+            } else {
+                render = leaf->u.rows[j]->render;
+                rsize = leaf->u.rows[j]->rsize;
+            }
+            ssize_t end;
+            ssize_t off = findNext(&c->m, render, rsize, 0, &end);
+            if (off >= 0) {
+                if (c->nlines == c->cap) {
+                    c->cap = c->cap ? c->cap * 2 : 64;
+                    c->lines = realloc(c->lines, c->cap * sizeof(ssize_t));
+                    c->counts = realloc(c->counts, c->cap * sizeof(ssize_t));
+                    if (c->lines == NULL || c->counts == NULL) {
+                        die("realloc");
+                    }
+                }
+                ssize_t count = 0;
+                while (off >= 0) {
+                    count++;
+                    off = findNext(&c->m, render, rsize,
+                                   findAfter(&c->m, off, end), &end);
+                }
+                c->lines[c->nlines] = at;
+                c->counts[c->nlines++] = count;
+            }
+            p = next;
         }
-        editorInsertRow(E.numrows, line, linelen);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return NULL;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+/* Find every line whose render holds the query. With `refine` only the lines
+ * found last time are looked at again. Leaves that were never loaded are
+ * searched where they are in the mapping, so a search loads nothing. A big
+ * search is cut into ranges of as many lines, or lines found last time, and
+ * searched on every core. Returns 0, with the last result gone, if a key
+ * came in first. */
+int editorFindScan(const struct findNeedle* nd, int refine) {
+    struct findState* f = &E.find;
+    ssize_t total = refine ? f->nlines : E.numrows;
+    long nchunks = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nchunks > total / FIND_CHUNK_MIN) {
+        nchunks = total / FIND_CHUNK_MIN;
+    }
+    if (nchunks > FIND_THREADS_MAX) {
+        nchunks = FIND_THREADS_MAX;
+    }
+    if (nchunks < 1) {
+        nchunks = 1;
+    }
+
+    struct findChunk chunks[FIND_THREADS_MAX];
+    ropeNode* leaf = ropeFirstLeaf();
+    ssize_t line = 0;
+    for (long i = 0; i < nchunks; i++) {
+        struct findChunk* c = &chunks[i];
+        ssize_t a = total * i / nchunks;
+        ssize_t b = total * (i + 1) / nchunks;
+        memset(c, 0, sizeof(*c));
+        c->main = i == 0;
+        findMatcherInit(&c->m, nd);
+        if (!refine) {
+            c->from = a;
+            c->to = b;
+        } else if (a < b) {
+            c->cand = f->lines + a;
+            c->ncand = b - a;
+            c->from = f->lines[a];
+            c->to = f->lines[b - 1] + 1;
+        }
+        while (leaf && line + leaf->count <= c->from) {
+            line += leaf->count;
+            leaf = leaf->next;
+        }
+        c->leaf = leaf;
+        c->leafline = line;
+    }
+    f->cancel = 0;
+    for (long i = 1; i < nchunks; i++) {
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL,
+                                           findChunkThread, &chunks[i]) == 0;
+        if (!chunks[i].started) {
+            findChunkThread(&chunks[i]);
         }
-        editorSelectSyntaxHighlight();
     }
+    findChunkThread(&chunks[0]);
 
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+    ssize_t n = 0;
+    for (long i = 0; i < nchunks; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
         }
-        close(fd);
+        n += chunks[i].nlines;
+    }
+    ssize_t* lines = NULL;
+    ssize_t* before = NULL;
+    if (!f->cancel && n > 0) {
+        lines = malloc(n * sizeof(ssize_t));
+        before = malloc(n * sizeof(ssize_t));
+        if (lines == NULL || before == NULL) {
+            die("malloc");
+        }
+    }
+    n = 0;
+    ssize_t matches = 0;
+    for (long i = 0; i < nchunks; i++) {
+        for (ssize_t k = 0; lines && k < chunks[i].nlines; k++, n++) {
+            lines[n] = chunks[i].lines[k];
+            before[n] = matches;
+            matches += chunks[i].counts[k];
+        }
+        free(chunks[i].lines);
+        free(chunks[i].counts);
+        free(chunks[i].scratch);
+        findMatcherFree(&chunks[i].m);
     }
+    free(f->lines);
+    free(f->before);
+    f->lines = lines;
+    f->before = before;
+    f->nlines = n;
+    f->total = matches;
+    return !f->cancel;
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// drop the query, keeping the lines it found for refining
+void editorFindForget() {
+    struct findState* f = &E.find;
+    findMatcherFree(&f->m);
+    reFree(f->nd.re);
+    f->nd.re = NULL;
+    free(f->query);
+    f->query = NULL;
+    f->error = NULL;
 }
 
+/* Move to a match as the query changes or the arrows step through them. The
+ * matches are found once per query, see editorFindScan, and stepping is
+ * just moving to the next one. The screen draws every match in view from
+ * the same list, so the hl of rows is never touched. Ctrl-R switches
+ * between plain text and regular expressions. */
 void editorFindCallback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    struct findState* f = &E.find;
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        editorFindForget();
+        free(f->lines);
+        free(f->before);
+        f->lines = NULL;
+        f->before = NULL;
+        f->nlines = 0;
+        f->total = 0;
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+    }
+    int step = 0;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        step = 1;
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-    }
-
-    if (last_match == -1) {
-        direction = 1;
-    }
-
-    int i;
-    int current = last_match;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.numrows - 1;
-        } else if (current == E.numrows) {
-            current = 0;
-        }
-
-        erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+        step = -1;
+    } else if (key == CTRL_KEY('r')) {
+        f->regex = !f->regex;
+        editorFindForget();
+    }
+
+    if (query[0] == '\0') {
+        // everything matches, wait for something to look for
+        editorFindForget();
+        f->nlines = 0;
+        f->total = 0;
+    } else if (f->query == NULL || strcmp(query, f->query) != 0) {
+        // a longer pattern can match more than a shorter one did
+        int refine = !f->regex && f->query &&
+                     strncmp(query, f->query, strlen(f->query)) == 0;
+        editorFindForget();
+        struct findNeedle nd;
+        const char* err = NULL;
+        if (f->regex) {
+            err = findNeedleRegex(&nd, query);
+        } else {
+            findNeedleInit(&nd, query);
         }
+        if (err) {
+            free(f->lines);
+            free(f->before);
+            f->lines = NULL;
+            f->before = NULL;
+            f->nlines = 0;
+            f->total = 0;
+            f->query = strdup(query);
+            f->error = err;
+            return;
+        }
+        if (!editorFindScan(&nd, refine)) {
+            reFree(nd.re);
+            return;  // the next key searches again
+        }
+        f->query = strdup(query);
+        f->nd = nd;
+        f->nd.s = f->query;
+        findMatcherInit(&f->m, &f->nd);
+        f->cur = 0;
+    } else if (step == 0) {
+        f->cur = 0;
+    } else if (f->total) {
+        f->cur = (f->cur + f->total + step) % f->total;
+    }
+    if (f->total == 0) {
+        return;
+    }
+
+    ssize_t k = findMatchIndex(f->cur);
+    ssize_t current = f->lines[k];
+    erow* row = editorRow(current);
+    editorRowRender(row);
+    ssize_t end;
+    ssize_t match = findNext(&f->m, row->render, row->rsize, 0, &end);
+    for (ssize_t m = f->before[k]; m < f->cur; m++) {
+        match = findNext(&f->m, row->render, row->rsize,
+                         findAfter(&f->m, match, end), &end);
     }
+    E.cy = current;
+    E.cx = editorRowRxToCx(row, match);
+    E.rowoff = E.numrows;
 }
 
 void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    findInInit();
+    ssize_t saved_cx = E.cx;
+    ssize_t saved_cy = E.cy;
+    ssize_t saved_coloff = E.coloff;
+    ssize_t saved_rowoff = E.rowoff;
 
     char* query =
-        editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+        editorPrompt("Search: %s (ESC/Arrows/Enter, Ctrl-R regex)",
+                     editorFindCallback);
     if (query) {
         free(query);
     } else {
@@ -801,24 +4219,41 @@ void editorFind() {
 }
 
 /*+++ append buffer +++*/
-struct abuf {
-    char* b;
-    int len;
-};
-
-#define ABUF_INIT \
-    { NULL, 0 }
-
-void abAppend(struct abuf* ab, const char* s, int len) {
-    char* new = realloc(ab->b, ab->len + len);
 
+// make room for `cap` bytes, 0 if there is no memory for them
+int abReserve(struct abuf* ab, ssize_t cap) {
+    if (cap <= ab->cap) {
+        return 1;
+    }
+    char* new = realloc(ab->b, cap);
     if (new == NULL) {
-        return;
+        return 0;
     }
-
-    memcpy(&new[ab->len], s, len);
     ab->b = new;
+    ab->cap = cap;
+    return 1;
+}
+
+// add `len` bytes to fill in, NULL if there is no memory for them
+char* abExtend(struct abuf* ab, ssize_t len) {
+    if (ab->len + len > ab->cap) {
+        ssize_t cap = ab->cap ? ab->cap : 1024;
+        while (cap < ab->len + len) {
+            cap *= 2;
+        }
+        if (!abReserve(ab, cap)) {
+            return NULL;
+        }
+    }
     ab->len += len;
+    return &ab->b[ab->len - len];
+}
+
+void abAppend(struct abuf* ab, const char* s, ssize_t len) {
+    char* p = abExtend(ab, len);
+    if (p) {
+        memcpy(p, s, len);
+    }
 }
 
 void abFree(struct abuf* ab) { free(ab->b); }
@@ -831,6 +4266,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
     size_t buflen = 0;
     buf[0] = '\0';
 
+    E.prompting = 1;
     while (1) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
@@ -846,6 +4282,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                 callback(buf, c);
             }
             free(buf);
+            E.prompting = 0;
             return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
@@ -853,6 +4290,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                 if (callback) {
                     callback(buf, c);
                 }
+                E.prompting = 0;
                 return buf;
             }
         } else if (!iscntrl(c) && c < 128) {
@@ -870,14 +4308,14 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 }
 
 void editorMoveCursor(int key) {
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRow(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -903,8 +4341,8 @@ void editorMoveCursor(int key) {
     // snap to end of line
     if (E.cy >= E.numrows) {
         E.cx = 0;
-    } else if (E.cx > E.row[E.cy].size) {
-        E.cx = E.row[E.cy].size;
+    } else if (E.cx > editorRow(E.cy)->size) {
+        E.cx = editorRow(E.cy)->size;
     }
 }
 void editorProcessKeypress() {
@@ -916,6 +4354,7 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('q'):
+            editorSaveWait();
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage(
                     "WARNING!!! File has unsaved changes. Press Ctrl-Q %d more "
@@ -939,7 +4378,7 @@ void editorProcessKeypress() {
 
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRow(E.cy)->size;
             }
             break;
 
@@ -947,6 +4386,10 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('g'):
+            editorShowInfo();
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):  // send delete as well
         case DEL_KEY:
@@ -1005,7 +4448,7 @@ void editorProcessKeypress() {
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
     }
     if (E.cy < E.rowoff) {
         E.rowoff = E.cy;
@@ -1024,7 +4467,189 @@ void editorScroll() {
     }
 }
 
-void editorDrawWelcome(struct abuf* ab) {
+// size the frames to the window, which has the whole screen written again
+void screenBegin() {
+    struct screenState* s = &E.screen;
+    int rows = E.screenrows + 2;  // with the status and the message bar
+    if (s->rows == rows && s->cols == E.screencols) {
+        return;
+    }
+    size_t n = (size_t)rows * E.screencols;
+    s->cur = realloc(s->cur, n * sizeof(struct screenCell));
+    s->next = realloc(s->next, n * sizeof(struct screenCell));
+    if (s->cur == NULL || s->next == NULL) {
+        die("realloc");
+    }
+    s->rows = rows;
+    s->cols = E.screencols;
+    s->valid = 0;
+    // enough for a screen of plain text, the first frame grows it to fit
+    abReserve(&s->out, n * 2);
+}
+
+// the cells of line y of the frame being drawn
+struct screenCell* screenLine(int y) {
+    return E.screen.next + (size_t)y * E.screen.cols;
+}
+
+// put `len` bytes on a line from column x on, returns the column after them
+int screenPuts(struct screenCell* line, int x, const char* s, int len,
+               unsigned char attr) {
+    for (int i = 0; i < len && x < E.screen.cols; i++, x++) {
+        line[x].c = s[i];
+        line[x].attr = attr;
+    }
+    return x;
+}
+
+// blank a line from column x on
+void screenClear(struct screenCell* line, int x) {
+    for (; x < E.screen.cols; x++) {
+        line[x].c = ' ';
+        line[x].attr = 0;
+    }
+}
+
+int screenCellEq(const struct screenCell* a, const struct screenCell* b) {
+    return a->c == b->c && a->attr == b->attr;
+}
+
+void screenMove(struct abuf* ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+}
+
+// switch the terminal from drawing with `from` to drawing with `to`
+void screenAttr(struct abuf* ab, unsigned char from, unsigned char to) {
+    if ((from ^ to) & SCREEN_INVERSE) {
+        if (to & SCREEN_INVERSE) {
+            abAppend(ab, "\x1b[7m", 4);
+        } else {
+            abAppend(ab, "\x1b[27m", 5);
+        }
+    }
+    const char* color = hlEscape[to & ~SCREEN_INVERSE];
+    if (memcmp(hlEscape[from & ~SCREEN_INVERSE], color, HL_ESCAPE_LEN)) {
+        abAppend(ab, color, HL_ESCAPE_LEN);
+    }
+}
+
+/* When the view moved up or down the file by fewer lines than the screen
+ * has, have the terminal move the lines it shows and do the same to cur, so
+ * the flush that follows only draws the lines brought in. The scroll region
+ * keeps the status and the message bar where they are. */
+void screenScroll(struct abuf* ab) {
+    struct screenState* s = &E.screen;
+    ssize_t d = E.rowoff - s->rowoff;
+    ssize_t n = d > 0 ? d : -d;
+    if (!s->valid || d == 0 || n >= E.screenrows || E.coloff != s->coloff) {
+        return;
+    }
+    // deleting lines at the top scrolls up, inserting them scrolls down
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[H\x1b[%zd%c\x1b[r",
+                       E.screenrows, n, d > 0 ? 'M' : 'L');
+    abAppend(ab, buf, len);
+    size_t width = s->cols;
+    size_t keep = (E.screenrows - n) * width;
+    struct screenCell* blank = s->cur;
+    if (d > 0) {
+        memmove(s->cur, s->cur + n * width, keep * sizeof(struct screenCell));
+        blank += keep;
+    } else {
+        memmove(s->cur + n * width, s->cur, keep * sizeof(struct screenCell));
+    }
+    for (size_t i = 0; i < n * width; i++) {
+        blank[i].c = ' ';
+        blank[i].attr = 0;
+    }
+}
+
+/* Write to ab what differs between the frame drawn and the screen. Each
+ * span of changed cells is written after a move of the cursor to it; equal
+ * cells between two changes are written again when that is shorter than
+ * moving past them. A line that ends in blanks is cut short with an erase,
+ * so deleting text costs no more than typing it. */
+void screenFlush(struct abuf* ab) {
+    struct screenState* s = &E.screen;
+    unsigned char attr = 0;  // what the terminal draws new cells with
+    if (!s->valid) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        for (size_t i = 0; i < (size_t)s->rows * s->cols; i++) {
+            s->cur[i].c = ' ';
+            s->cur[i].attr = 0;
+        }
+        s->valid = 1;
+    }
+    for (int y = 0; y < s->rows; y++) {
+        const struct screenCell* cur = s->cur + (size_t)y * s->cols;
+        const struct screenCell* next = s->next + (size_t)y * s->cols;
+        int blank = s->cols;  // where the blanks ending the line start
+        while (blank > 0 && next[blank - 1].c == ' ' &&
+               next[blank - 1].attr == 0) {
+            blank--;
+        }
+        int at = -1;  // the column of the cursor on this line, if it is on it
+        int x = 0;
+        while (x < s->cols) {
+            if (screenCellEq(&cur[x], &next[x])) {
+                x++;
+                continue;
+            }
+            if (at != x) {
+                screenMove(ab, y, x);
+            }
+            if (x >= blank) {
+                if (attr) {
+                    screenAttr(ab, attr, 0);
+                    attr = 0;
+                }
+                abAppend(ab, "\x1b[K", 3);
+                break;
+            }
+            int end = x;
+            for (;;) {
+                while (end < blank && !screenCellEq(&cur[end], &next[end])) {
+                    end++;
+                }
+                int gap = end;
+                while (gap < blank && screenCellEq(&cur[gap], &next[gap])) {
+                    gap++;
+                }
+                if (gap == blank || gap - end > SCREEN_GAP) {
+                    break;
+                }
+                end = gap;
+            }
+            // a run of cells drawn alike at a time
+            while (x < end) {
+                if (next[x].attr != attr) {
+                    screenAttr(ab, attr, next[x].attr);
+                    attr = next[x].attr;
+                }
+                int run = x + 1;
+                while (run < end && next[run].attr == attr) {
+                    run++;
+                }
+                char* out = abExtend(ab, run - x);
+                for (; out && x < run; x++) {
+                    *out++ = next[x].c;
+                }
+                x = run;
+            }
+            at = x;
+        }
+    }
+    if (attr) {
+        screenAttr(ab, attr, 0);
+    }
+    struct screenCell* swap = s->cur;
+    s->cur = s->next;
+    s->next = swap;
+}
+
+int editorDrawWelcome(struct screenCell* line) {
     char welcome[80];
     int welcomelen = snprintf(welcome, sizeof(welcome),
                               "Kilo editor -- version %s", KILO_VERSION);
@@ -1033,135 +4658,172 @@ void editorDrawWelcome(struct abuf* ab) {
     }
 
     int padding = (E.screencols - welcomelen) / 2;
-    if (padding) {
-        abAppend(ab, "~", 1);
-    }
+    int x = padding ? screenPuts(line, 0, "~", 1, 0) : 0;
 
     // center the welcome message
-    while (padding--) {
-        abAppend(ab, " ", 1);
-    }
-
-    abAppend(ab, welcome, welcomelen);
+    screenClear(line, x);
+    return screenPuts(line, x + padding, welcome, welcomelen, 0);
 }
 
-void editorDrawRows(struct abuf* ab) {
+void editorDrawRows() {
     int y;
+    erow* row = editorRow(E.rowoff);
+    // the next line with search matches, drawn over the hl of the row
+    struct findState* f = &E.find;
+    ssize_t k = f->query ? findLineIndex(E.rowoff) : f->nlines;
     for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
+        struct screenCell* line = screenLine(y);
+        int x = 0;
+        if (row == NULL) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
-                editorDrawWelcome(ab);
+                x = editorDrawWelcome(line);
             } else {
-                abAppend(ab, "~", 1);
+                x = screenPuts(line, 0, "~", 1, 0);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            editorRowHighlight(row, y + E.rowoff);
+            ssize_t len = row->rsize - E.coloff;
             if (len < 0) {
                 len = 0;
             }
             if (len > E.screencols) {
                 len = E.screencols;
             }
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm",
-                                            current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
+            char* c = &row->render[E.coloff];
+            hlSpan* span = row->hl;
+            hlSpan* lastspan = row->hl + row->nspans;
+            ssize_t spanend = 0;  // render column the span before `span` ends
+            ssize_t match = -1;   // the first match not ended yet
+            ssize_t matchend = 0;
+            if (k < f->nlines && f->lines[k] == y + E.rowoff) {
+                match = findNext(&f->m, row->render, row->rsize, 0,
+                                 &matchend);
+                k++;
+            }
+            // a run of one hl, up to where a span or a match starts or ends
+            for (x = 0; x < len;) {
+                ssize_t at = E.coloff + x;
+                while (spanend <= at && span < lastspan) {
+                    spanend += HL_SPAN_LEN(*span++);
+                }
+                int hl = HL_NORMAL;
+                ssize_t end = E.coloff + len;
+                if (spanend > at) {
+                    hl = HL_SPAN_HL(span[-1]);
+                    end = spanend;
+                }
+                while (match >= 0 && matchend <= at) {
+                    match = findNext(&f->m, row->render, row->rsize,
+                                     findAfter(&f->m, match, matchend),
+                                     &matchend);
+                }
+                if (match >= 0 && match <= at) {
+                    hl = HL_MATCH;
+                    end = matchend;
+                } else if (match >= 0 && match < end) {
+                    end = match;
+                }
+                if (end > E.coloff + len) {
+                    end = E.coloff + len;
+                }
+                for (; x < end - E.coloff; x++) {
+                    line[x].c = c[x];
+                    line[x].attr = hl;
+                    if (iscntrl(c[x])) {
+                        line[x].c = (c[x] <= 26) ? '@' + c[x] : '?';
+                        line[x].attr |= SCREEN_INVERSE;
                     }
-                    abAppend(ab, &c[j], 1);
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
+            row = editorRowNext(row);
         }
-
-        abAppend(ab, "\x1b[K", 3);  // erase current line
-        abAppend(ab, "\r\n", 2);
+        screenClear(line, x);
     }
 }
 
-void editorDrawMessageBar(struct abuf* ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+    struct screenCell* line = screenLine(E.screenrows + 1);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) {
         msglen = E.screencols;
     }
+    int x = 0;
     if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        abAppend(ab, E.statusmsg, msglen);
+        x = screenPuts(line, 0, E.statusmsg, msglen, 0);
     }
+    screenClear(line, x);
 }
 
-void editorDrawStatusBar(struct abuf* ab) {
-    abAppend(ab, "\x1b[7m", 4);  // switch to inverted colors
+void editorDrawStatusBar() {
+    struct screenCell* line = screenLine(E.screenrows);
     char status[80];
     char rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    int len = snprintf(status, sizeof(status), "%.20s - %zd lines %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
                        E.dirty ? "(modified)" : "");
-    int rlen =
-        snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                 E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+    int rlen = 0;
+    if (E.find.error) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "regex: %s | ",
+                        E.find.error);
+    } else if (E.find.query) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %zd of %zd | ",
+                        E.find.regex ? "regex " : "",
+                        E.find.total ? E.find.cur + 1 : 0, E.find.total);
+    }
+    rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen, "%s | %zd/%zd",
+                     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                     E.numrows);
 
     if (len > E.screencols) {
         len = E.screencols;
     }
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+    // in inverted colors
+    int x = screenPuts(line, 0, status, len, SCREEN_INVERSE);
+    while (x < E.screencols) {
+        if (E.screencols - x == rlen) {
+            screenPuts(line, x, rstatus, rlen, SCREEN_INVERSE);
             break;
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            x = screenPuts(line, x, " ", 1, SCREEN_INVERSE);
         }
     }
-    abAppend(ab, "\x1b[m", 3);  // swtich to normal colors
-    abAppend(ab, "\r\n", 2);    // add another status bar
 }
 
+/* Draw the next frame and write what changed. With nothing changed only the
+ * cursor is moved, if it moved at all. */
 void editorRefreshScreen() {
+    struct screenState* s = &E.screen;
     editorScroll();
-    struct abuf ab = ABUF_INIT;
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);  // cusor at the top left corner
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    screenBegin();
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    struct abuf* ab = &s->out;
+    ab->len = 0;
+    abAppend(ab, "\x1b[?25l", 6);  // hide the cursor while drawing
+    screenScroll(ab);
+    screenFlush(ab);
+    int drawn = ab->len > 6;
+    if (!drawn) {
+        ab->len = 0;
+    }
+    ssize_t cy = E.cy - E.rowoff;
+    ssize_t cx = E.rx - E.coloff;
+    if (drawn || cy != s->cy || cx != s->cx) {
+        screenMove(ab, cy, cx);
+    }
+    if (drawn) {
+        abAppend(ab, "\x1b[?25h", 6);
+    }
+    s->cy = cy;
+    s->cx = cx;
+    s->rowoff = E.rowoff;
+    s->coloff = E.coloff;
+    s->written = ab->len;
+    if (ab->len) {
+        write(STDOUT_FILENO, ab->b, ab->len);
+    }
 }
 
 void editorSetStatusMessage(const char* fmt, ...) {
@@ -1180,12 +4842,21 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.hlstale = 0;
+    E.hlbuf = NULL;
+    E.hlbufcap = 0;
+    E.map = NULL;
+    E.maplen = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+    E.prompting = 0;
     E.syntax = NULL;
+    pthread_mutex_init(&E.save.lock, NULL);
+    pthread_mutex_init(&E.hl.lock, NULL);
+    pthread_mutex_init(&E.find.lock, NULL);
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
         die("getWindowSize");
@@ -1200,7 +4871,7 @@ int main(int argc, char* argv[]) {
     }
 
     editorSetStatusMessage(
-        "HELP: CTRL-s = save | Ctrl-q = quit | Ctrl-F = find");
+        "HELP: CTRL-s = save | Ctrl-q = quit | Ctrl-F = find | Ctrl-G = info");
     while (1) {
         editorRefreshScreen();
         editorProcessKeypress();